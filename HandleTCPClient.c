@@ -8,190 +8,200 @@
 #include <unistd.h>     /* for close() */
 #endif
 
-#include "nu4.h"
-
-#define RCVBUFSIZE 132   /* Size of receive buffer */
+#include "HandleTCPClient.h"
 
 void DieWithError(char *errorMessage);  /* Error handling function */
 
-#define MAXCMD 128
-static char* pCmd;
-static char cmd[MAXCMD];
-static int _row; // Row counter
-
-static char* pkt;
-
-static int rowAddress; // The address of this row
+// Normal command mode
+#define MODENORMAL 0
+#define MODESOFTELPAGEINIT 1
+// Get row count
+#define MODEGETROWCOUNT 3
+// Get a row of data: two hammed address bytes and 40 characters
+#define MODEGETROW 4
 
-void command(char* cmd, char* response)
+void command(char* cmd, char* response, int size)
 {
 	switch (cmd[0])
 	{
 	case 'T' :; 
-		if (response) strcpy(response,"T not implemented\n");
+		snprintf(response,size,"T not implemented\n");
 		break;
 		
 	case 'Y' : 
-		if (response) strcpy(response,"VBIT620\n");
+		snprintf(response,size,"VBIT620\n");
 		break;
-	case 0x0e:
-		if (response) strcpy(response,"This of course does not work. No CR in Softel \n\r");
+	case 'S' :	// Status. The pipeline metrics, one name=value per line
+		metricsFormat(response,size);
 		break;
 	}
 } // command
 
-void clearCmd(void)
+/** expect - Collect a Newfor field into cmd before going on
+ * \param need : Length of the field
+ * \param ch : The Newfor command byte, kept in front of the field. 0 for none.
+ */
+static void expect(TCPCLIENT *c, int mode, int need, char ch)
 {
-	*cmd=0;
-	pCmd=cmd;
+	c->mode=mode;
+	c->len=0;
+	if (ch)
+		c->cmd[c->len++]=ch;
+	c->need=c->len+need;
 }
 
-// Normal command mode
-#define MODENORMAL 0
-#define MODESOFTELPAGEINIT 1
-// Get row count
-#define MODEGETROWCOUNT 3
-// Get a row of data
-#define MODEGETROW 4
-// Display the row
-#define MODESUBTITLEONAIR 5
-// Clear down
-#define MODESUBTITLEOFFAIR 6
-#define MODESUBTITLEDATAHIGHNYBBLE 7
-#define MODESUBTITLEDATALOWNYBBLE 8
-
+void clientInit(TCPCLIENT *c)
+{
+	expect(c,MODENORMAL,0,0);
+	newforInit(&c->newfor);
+	c->rowCount=0;
+	c->rows=0;
+	c->bad=0;
+}
 
-/** AddChar
- * Add a char to the command buffer and call command when we get CR 
- * There is only a response if a command needs to send something back.
- * If the first character is a Nu4 character then the data is parsed as Nu4.
- * Commands that are not Newfor are MODENORMAL. They are stateless (so far)
- * The state machine for OnAir and OffAir is not needed as they happen immediately.
- * MODESOFTELPAGEINIT sets a char count and when it gets the four chars it resets.
- * When loading subtitle data MODEGETROWCOUNT gets the row count then repeats for each row
- * MODESUBTITLEDATAHIGHNYBBLE, MODESUBTITLEDATALOWNYBBLE and MODEGETROW
+/** normalInput - Take command characters up to the end of a line
+ * The first character of a command may be a Newfor command instead.
+ * OnAir and OffAir happen immediately and need no reply.
+ * Page Init and Subtitle Data start collecting their fields.
+ * \return The number of characters used
  */
-void addChar(char ch, char* response)
+static int normalInput(TCPCLIENT *c, char *data, int len, char* response, int size)
 {
-	static int mode=MODENORMAL;
-	static int charCount=0;
-	int n;
+	int i;
 	response[0]=0;
-	switch (mode)
+	if (!c->len)
 	{
-	case MODENORMAL :
-		pkt=cmd;
-		if (pCmd==cmd) // On the first character we check if it is a Softel
-		{
-			switch (ch)
-			{
-			case 0x0e :
-				mode=MODESOFTELPAGEINIT; // page 0nnn
-				charCount=4;
-				break;
-			case 0x0f :
-				mode=MODEGETROWCOUNT; // n and n*(rowhigh, rowlow, 40 bytes) 
-				break;
-			case 0x10 :
-				// Put the subtitle on air immediately
-				SubtitleOnair(response);
-//				strcpy(response, "On Air");
-				mode=MODENORMAL;			
-				clearCmd();
-				return;
-			case 0x18 :
-				// Remove the subtitle immediately
-				SubtitleOffair();
-				strcpy(response, "[addChar]Clear");
-				clearCmd();
-				mode=MODENORMAL;			
-				return;
-			}
-		} // If first character
-		if (ch!='\n' && ch!='\r')
+		switch (data[0])
 		{
-			*pCmd++=ch;
-			if (response) response[0]=0;
+		case 0x0e :	// Page Init: 0 and the page number, four hammed bytes
+			expect(c,MODESOFTELPAGEINIT,4,data[0]);
+			return 1;
+		case 0x0f :	// Subtitle Data: the row count, then each row
+			expect(c,MODEGETROWCOUNT,1,data[0]);
+			return 1;
+		case 0x10 :	// Put the subtitle on air immediately
+			SubtitleOnair(&c->newfor);
+			return 1;
+		case 0x18 :	// Remove the subtitle immediately
+			SubtitleOffair(&c->newfor);
+			return 1;
 		}
-		else
+	}
+	for (i=0;i<len;i++)
+	{
+		if (data[i]=='\n' || data[i]=='\r')
 		{
 			// Got a complete command
-			// printf("cmd=%s\n",cmd);
-			command(cmd, response);
-			clearCmd();
-			mode=MODENORMAL;			
+			c->cmd[c->len]=0;
+			if (c->len)
+				command(c->cmd, response, size);
+			c->len=0;
+			return i+1;
 		}
-		break;
-	case MODESOFTELPAGEINIT:	// We get four more characters and then the page is set	
-		// @todo If a nybble fails deham or isn't in range we should return nack
-		*pCmd++=ch;
-		charCount--;
-		if (!charCount)
+		if (c->len<MAXCMD-1)	// Anything longer than a command can be is junk
+			c->cmd[c->len++]=data[i];
+	}
+	return len;
+}
+
+/** fieldDone - Act on a complete Newfor field
+ * \return ACK, NACK or 0 for no reply yet
+ */
+static char fieldDone(TCPCLIENT *c)
+{
+	int hi,lo;
+	int n;
+	switch (c->mode)
+	{
+	case MODESOFTELPAGEINIT:
+		expect(c,MODENORMAL,0,0);
+		n=SoftelPageInit(c->cmd);
+		if (n>=0x900)
+			return NACK;
+		c->newfor.page=n;
+		return ACK;
+	case MODEGETROWCOUNT:
+		n=GetRowCount(c->cmd);
+		if (!n)
 		{
-			int page=SoftelPageInit(cmd);
-			sprintf(response,"[addChar]MODESOFTELPAGEINIT Set page=%03x",page);
-			// Now that we are done, set up for the next command
-			mode=MODENORMAL;
-			clearCmd();
+			expect(c,MODENORMAL,0,0);
+			return NACK;
 		}
-		break;
-	case MODEGETROWCOUNT:
-		*pCmd++=ch;
-		n=GetRowCount(cmd);
-	    sprintf(response,"[addChar]Row count=%d\n",n);
-		mode=MODESUBTITLEDATAHIGHNYBBLE;
-		_row=n;
-		break;
-	case MODESUBTITLEDATAHIGHNYBBLE:
-		*pCmd++=ch;
-		charCount=40;
-		mode=MODESUBTITLEDATALOWNYBBLE;
-		rowAddress=vbi_unham8(ch)*16; // @todo Check validity
-		break;
-	case MODESUBTITLEDATALOWNYBBLE:
-		*pCmd++=ch;
-		rowAddress+=vbi_unham8(ch); // @todo Check validity
-	    sprintf(response,"[addChar]MODESUBTITLEDATALOWNYBBLE row=%d\n",rowAddress);
-		mode=MODEGETROW;
-		pkt=pCmd; // Save the start of this packet
-		break;
+		c->rowCount=n;
+		c->rows=0;
+		c->bad=0;
+		expect(c,MODEGETROW,42,0);
+		return 0;
 	case MODEGETROW:
-		*pCmd++=ch;
-		charCount--;
-		if (charCount<=0) // End of line?
+		hi=vbi_unham8((uint8_t)c->cmd[0]);
+		lo=vbi_unham8((uint8_t)c->cmd[1]);
+		n=hi*16+lo;
+		if (hi<0 || lo<0 || n<1 || n>24)
+			c->bad=1;	// Keep going so we stay in step with the block
+		c->rowAddress[c->rows]=n;
+		memcpy(c->rowText[c->rows],c->cmd+2,40);
+		if (++c->rows<c->rowCount)
 		{
-			sprintf(response,"[addChar] MODEGETROW_row=%d\n",_row);
-			// Generate the teletext packet
-			saveSubtitleRow(8,rowAddress,pkt);
-			if (_row>1) // Next row
-			{
-				_row--;
-				mode=MODESUBTITLEDATAHIGHNYBBLE;
-			}
-			else // Last row
-			{
-				// Now that we are done, set up for the next command
-				sprintf(response,"subtitle data complete\n");
-				mode=MODENORMAL;
-				clearCmd();				
-			}
+			expect(c,MODEGETROW,42,0);
+			return 0;
 		}
-		break;
-	} // State machine switch			
+		// The whole block has arrived. It only goes on if every row was good.
+		expect(c,MODENORMAL,0,0);
+		if (c->bad || !SubtitleData(&c->newfor,c->rows,c->rowAddress,c->rowText))
+			return NACK;
+		return ACK;
+	}
+	return 0;
 }
 
+int clientReceive(TCPCLIENT *c, char *data, int len, char *response, int size, int *taken)
+{
+	int n=0;	// Length of the replies
+	int used;
+	char reply;
+	*taken=0;
+	while (len>0 && size-n>=RESPONSESIZE)	// Only go on while the biggest reply would fit
+	{
+		if (c->mode==MODENORMAL)
+		{
+			used=normalInput(c,data,len,response+n,size-n);
+			n+=strlen(response+n);
+		}
+		else
+		{
+			// Copy as much of the field as we have
+			used=c->need-c->len;
+			if (used>len)
+				used=len;
+			memcpy(c->cmd+c->len,data,used);
+			c->len+=used;
+			if (c->len>=c->need && (reply=fieldDone(c)) && n<size-1)
+				response[n++]=reply;
+		}
+		data+=used;
+		len-=used;
+		*taken+=used;
+	}
+	response[n]=0;
+	return n;
+}
 
 /** HandleTCPClient
  *  Commands will come in here.
  * They need to be accumulated and when we have a complete line, send it to a command interpreter.
+ * The server uses clientReceive directly. This is for where there is only a blocking socket.
  */
 void HandleTCPClient(int clntSocket)
 {
     char echoBuffer[RCVBUFSIZE];        /* Buffer for echo string */
-	char response[RCVBUFSIZE];
+	char response[RESPONSESIZE];
     int recvMsgSize;                    /* Size of received message */
-	int i;
-	clearCmd();
+	int n;
+	int left;	// Bytes of echoBuffer not parsed yet
+	int taken;
+	char *data;
+	static TCPCLIENT client;	// Its subtitles can still be going out after it returns
+	clientInit(&client);
 	
     /* Send received string and receive again until end of transmission */
     for (recvMsgSize=1;recvMsgSize > 0;)      /* zero indicates end of transmission */
@@ -199,14 +209,12 @@ void HandleTCPClient(int clntSocket)
         /* See if there is more data to receive */
         if ((recvMsgSize = recv(clntSocket, echoBuffer, RCVBUFSIZE, 0)) < 0)
             DieWithError("recv() failed");
-		for (i=0;i<recvMsgSize;i++)
+		// response only has room for one full reply, so send as often as it fills
+		for (data=echoBuffer,left=recvMsgSize;left>0;data+=taken,left-=taken)
 		{
-			addChar(echoBuffer[i], response);
-				if (*response) send(clntSocket, response, strlen(response), 0);
+			n=clientReceive(&client,data,left,response,RESPONSESIZE,&taken);
+			if (n) send(clntSocket, response, n, 0);
 		}
-        /* Echo message back to client */
-        //if (send(clntSocket, echoBuffer, recvMsgSize, 0) != recvMsgSize)
-        //    DieWithError("send() failed");
     }
 
     close(clntSocket);    /* Close client socket */
@@ -0,0 +1,64 @@
+/**
+ * @file HandleTCPClient.h
+ * @brief Command and Newfor parser for the network port.
+ */
+#ifndef _HANDLETCPCLIENT_H_
+#define _HANDLETCPCLIENT_H_
+
+#include <stdio.h>
+#include <string.h>
+
+#include "nu4.h"
+#include "metrics.h"
+
+#define RCVBUFSIZE 132   /* Size of receive buffer */
+#define RESPONSESIZE METRICSTEXTSIZE	/* Big enough for the status report */
+#define MAXCMD 128
+
+/** The parser state of one connection.
+ * Every client has its own, so a command can arrive in pieces
+ * without getting mixed up with another client's.
+ * A Newfor subtitle block is kept here until all of it has arrived and
+ * dehammed, then it is encoded into one of the subtitle slots in newfor.
+ * Those slots may still be on air after the client has gone, so a TCPCLIENT
+ * must not be freed or reused for anything else.
+ */
+typedef struct _TCPCLIENT_
+{
+	int mode;			/// MODENORMAL etc.
+	int need;			/// Bytes that the Newfor field being received takes
+	int len;			/// Bytes in cmd so far
+	char cmd[MAXCMD];	/// The command line, or the Newfor field, so far
+	NEWFOR newfor;		/// The page and the subtitle slots
+	int rowCount;		/// Rows in the subtitle block being received
+	int rows;			/// Rows received so far
+	uint8_t bad;		/// Set if a row of this block had a bad address
+	uint8_t rowAddress[SUBTITLEROWS];	/// The row numbers of the block
+	char rowText[SUBTITLEROWS][40];		/// and their text
+} TCPCLIENT;
+
+/** clientInit - Set up the parser for a new connection
+ */
+void clientInit(TCPCLIENT *c);
+
+/** clientReceive - Parse some bytes from a client
+ * The replies to everything in data are put one after the other in response,
+ * so that they can be sent back in one go. Newfor commands only ever get
+ * ACK or NACK, and OnAir and OffAir get nothing.
+ * Parsing stops once there is less than RESPONSESIZE left in response, so a
+ * reply is never cut short. The caller passes the rest of data in again once
+ * the replies have gone.
+ * \param data : The bytes received
+ * \param len : Number of bytes
+ * \param response : Receives the replies
+ * \param size : Size of response
+ * \param taken : Receives the number of bytes of data that were parsed
+ * \return Length of the replies
+ */
+int clientReceive(TCPCLIENT *c, char *data, int len, char *response, int size, int *taken);
+
+/** HandleTCPClient - Serve a client on a blocking socket until it disconnects
+ */
+void HandleTCPClient(int clntSocket);
+
+#endif
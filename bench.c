@@ -0,0 +1,199 @@
+/** ***************************************************************************
+ * Name				: bench.c
+ * Description       : VBIT Encoder benchmark. Build and run with make bench
+ * Times the block encoders against the one byte at a time tables
+ * and checks that they agree.
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "encode.h"
+#include "delay.h"
+
+// Number of packets to encode in each test
+#define BENCHPACKETS 2000000
+
+// Stops the compiler from optimising the work away
+static volatile uint8_t sink;
+
+/** parityTable - The old way. One table look up per byte
+ */
+static void parityTable(uint8_t *p, unsigned int n)
+{
+	unsigned int i;
+	for (i=0;i<n;i++)
+		p[i]=ParTab[p[i]&0x7f];
+}
+
+/** hamTable - The old way. One table look up per byte
+ */
+static void hamTable(uint8_t *dst, const uint8_t *nibbles, unsigned int n)
+{
+	unsigned int i;
+	for (i=0;i<n;i++)
+		dst[i]=HamTab[nibbles[i]&0x0f];
+}
+
+/** ham24Table - The old way. One triplet at a time
+ */
+static void ham24Table(uint8_t *dst, const unsigned int *triplets, unsigned int n)
+{
+	unsigned int i;
+	for (i=0;i<n;i++)
+		vbi_ham24p(dst+3*i,triplets[i]);
+}
+
+/** report - Print the rate of one test
+ */
+static void report(const char *name, uint64_t start)
+{
+	uint64_t t=micros()-start;
+	if (!t) t=1;
+	printf("%-34s %10.0f packets/s\n",name,BENCHPACKETS*1e6/t);
+}
+
+/** check - Compare the block encoders with the tables
+ * \return The number of differences
+ */
+static int check(void)
+{
+	uint8_t a[256],b[256],c[3*64],d[3*64];
+	unsigned int t[64];
+	int i;
+	int errors=0;
+	for (i=0;i<256;i++)
+		a[i]=b[i]=i;
+	parityTable(a,256);
+	ParityEncode(b,256);
+	errors+=memcmp(a,b,256)!=0;
+	for (i=0;i<256;i++)
+		b[i]=i;
+	hamTable(a,b,256);
+	HamEncode(c,b,64);	// Odd lengths go through the tail loop
+	HamEncode(c+64,b+64,100);
+	HamEncode(c+164,b+164,92);
+	errors+=memcmp(a,c,256)!=0;
+	for (i=0;i<64;i++)
+		t[i]=(i*0x2f0d1)&0x3ffff;
+	ham24Table(c,t,64);
+	Ham24Encode(d,t,64);
+	errors+=memcmp(c,d,3*64)!=0;
+	return errors;
+}
+
+int main(void)
+{
+	uint8_t row[40];
+	uint8_t nib[37];
+	uint8_t out[3*13];
+	unsigned int triplet[13];
+	uint64_t start;
+	long i;
+	int j;
+
+	printf("Encoder kernels: %s\n",EncodeKernel());
+	if (check())
+	{
+		printf("MISMATCH between the block encoders and the tables\n");
+		return 1;
+	}
+
+	// Parity on a 40 character text row
+	for (j=0;j<40;j++) row[j]='A'+j%26;
+	start=micros();
+	for (i=0;i<BENCHPACKETS;i++)
+	{
+		row[i%40]^=(uint8_t)i;
+		parityTable(row,40);
+	}
+	sink=row[0];
+	report("Parity row (table)",start);
+	start=micros();
+	for (i=0;i<BENCHPACKETS;i++)
+	{
+		row[i%40]^=(uint8_t)i;
+		ParityEncode(row,40);
+	}
+	sink=row[0];
+	report("Parity row (ParityEncode)",start);
+
+	// Hamming 8/4 on the eight header bytes
+	for (j=0;j<8;j++) nib[j]=j;
+	start=micros();
+	for (i=0;i<BENCHPACKETS;i++)
+	{
+		nib[i%8]=(uint8_t)i;
+		hamTable(out,nib,8);
+	}
+	sink=out[0];
+	report("Ham 8/4 header (table)",start);
+	start=micros();
+	for (i=0;i<BENCHPACKETS;i++)
+	{
+		nib[i%8]=(uint8_t)i;
+		HamEncode(out,nib,8);
+	}
+	sink=out[0];
+	report("Ham 8/4 header (HamEncode)",start);
+
+	// Hamming 8/4 on the 37 bytes of an X/27 fastext packet
+	for (j=0;j<37;j++) nib[j]=j;
+	start=micros();
+	for (i=0;i<BENCHPACKETS;i++)
+	{
+		nib[i%37]=(uint8_t)i;
+		hamTable(out,nib,37);
+	}
+	sink=out[0];
+	report("Ham 8/4 X/27 (table)",start);
+	start=micros();
+	for (i=0;i<BENCHPACKETS;i++)
+	{
+		nib[i%37]=(uint8_t)i;
+		HamEncode(out,nib,37);
+	}
+	sink=out[0];
+	report("Ham 8/4 X/27 (HamEncode)",start);
+
+	// Hamming 24/18 on the 13 triplets of an X/28 packet
+	for (j=0;j<13;j++) triplet[j]=j<<10;
+	start=micros();
+	for (i=0;i<BENCHPACKETS;i++)
+	{
+		triplet[i%13]=i&0x3ffff;
+		ham24Table(out,triplet,13);
+	}
+	sink=out[0];
+	report("Ham 24/18 X/28 (vbi_ham24p)",start);
+	start=micros();
+	for (i=0;i<BENCHPACKETS;i++)
+	{
+		triplet[i%13]=i&0x3ffff;
+		Ham24Encode(out,triplet,13);
+	}
+	sink=out[0];
+	report("Ham 24/18 X/28 (Ham24Encode)",start);
+	return 0;
+}
@@ -0,0 +1,135 @@
+/** ***************************************************************************
+ * Name				: benchmode.c
+ * Description       : VBIT Throughput benchmark
+ * Samples the buffer levels while the pipeline runs flat out and then
+ * reports the rate of real packets and the CPU time each stage used per packet.
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+
+#include "benchmode.h"
+
+// Buffer level histogram: empty, four quarters, full
+#define BENCHBUCKETS 6
+
+/** benchLevel - Count one look at a buffer in its histogram
+ */
+static void benchLevel(unsigned long *hist, bufferpacket *bp)
+{
+	unsigned int level=bufferLevel(bp);
+	if (!level)
+		hist[0]++;
+	else if (level>=bp->count)
+		hist[BENCHBUCKETS-1]++;
+	else
+		hist[1+level*4/bp->count]++;
+}
+
+/** benchPackets - Real packets that Stream has sent so far
+ * Magazines, subtitles and 8/30. Quiet and filler lines aren't counted.
+ */
+static unsigned long benchPackets(void)
+{
+	unsigned long n=metricsGet(metrics.subtitleLines)+metricsGet(metrics.serviceLines);
+	int i;
+	for (i=0;i<8;i++)
+		n+=metricsGet(metrics.magLines[i]);
+	return n;
+}
+
+/** benchPrintLevels - One row of the histogram table
+ */
+static void benchPrintLevels(const char *name, unsigned long *hist, unsigned long samples)
+{
+	int i;
+	fprintf(stderr,"[bench] %-10s",name);
+	for (i=0;i<BENCHBUCKETS;i++)
+		fprintf(stderr," %5.1f%%",100.0*hist[i]/samples);
+	fputc('\n',stderr);
+}
+
+void benchRun(unsigned int seconds, sigset_t *signals, pthread_t streamThread, pthread_t outputThread)
+{
+	unsigned long streamHist[BENCHBUCKETS]={0};
+	unsigned long magHist[8][BENCHBUCKETS]={{0}};
+	unsigned long samples=0;
+	unsigned long packets, lines, quiet, filler;
+	uint64_t magUsed, streamUsed, outputUsed;
+	uint64_t start, end, elapsed;
+	char name[12];
+	int i;
+	#ifndef WIN32
+	struct timespec tick={0,1000000};	// Look at the buffers every millisecond
+	#endif
+
+	fprintf(stderr,"[bench] Running for %u seconds\n",seconds);
+	// Only count what happens from here, not the page loading
+	magUsed=magCpu();
+	streamUsed=piThreadCpu(streamThread);
+	outputUsed=piThreadCpu(outputThread);
+	packets=benchPackets();
+	lines=outputLines();
+	quiet=metricsGet(metrics.quietLines);
+	filler=metricsGet(metrics.fillerLines);
+	start=micros();
+	end=start+(uint64_t)seconds*1000000;
+	while (micros()<end)
+	{
+		#ifndef WIN32
+		if (sigtimedwait(signals,NULL,&tick)>=0)
+			break;	// Stopped early
+		#else
+		delay(1);
+		#endif
+		benchLevel(streamHist,streamBuffer);
+		for (i=0;i<8;i++)
+			benchLevel(magHist[i],&magBuffer[i]);
+		samples++;
+	}
+	// The threads are still running, so their clocks can still be read
+	magUsed=magCpu()-magUsed;
+	streamUsed=piThreadCpu(streamThread)-streamUsed;
+	outputUsed=piThreadCpu(outputThread)-outputUsed;
+	packets=benchPackets()-packets;
+	lines=outputLines()-lines;
+	quiet=metricsGet(metrics.quietLines)-quiet;
+	filler=metricsGet(metrics.fillerLines)-filler;
+	elapsed=micros()-start;
+	if (!elapsed) elapsed=1;
+	if (!samples) samples=1;
+
+	// Padding goes out at any speed, so only the real packets say how fast vbit is
+	fprintf(stderr,"[bench] %lu packets in %.2f s, %.0f packets/s, %.1f times real time at 50 Hz\n",
+		packets,elapsed/1e6,packets*1e6/elapsed,packets*1e6/elapsed/(25*(fieldLineCount[0]+fieldLineCount[1])));
+	fprintf(stderr,"[bench] %lu lines written, %lu quiet and %lu filler (%.1f%% padding)\n",
+		lines,quiet,filler,lines ? 100.0*(quiet+filler)/lines : 0.0);
+	if (packets)
+		fprintf(stderr,"[bench] CPU per packet: magazines %.3f us, stream %.3f us, output %.3f us\n",
+			(double)magUsed/packets,(double)streamUsed/packets,(double)outputUsed/packets);
+	fprintf(stderr,"[bench] buffer       empty   <25%%   <50%%   <75%%  <100%%   full\n");
+	benchPrintLevels("stream",streamHist,samples);
+	for (i=1;i<=8;i++)
+	{
+		snprintf(name,sizeof(name),"mag %d",i);
+		benchPrintLevels(name,magHist[i%8],samples);
+	}
+	streamReport(stderr);
+} // benchRun
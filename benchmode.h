@@ -0,0 +1,55 @@
+/** ***************************************************************************
+ * Description       : VBIT Throughput benchmark
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+#ifndef _BENCHMODE_H_
+#define _BENCHMODE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "thread.h"
+#include "delay.h"
+#include "buffer.h"
+#include "mag.h"
+#include "stream.h"
+#include "outputstream.h"
+#include "metrics.h"
+
+/** vbit --bench runs the whole pipeline, domag to bufferMove to Stream to
+ * OutputStream, as fast as it will go with the output thrown away.
+ * Use the benchpages script to make a page set to run it on.
+ */
+
+/** benchRun - Watch the threads for a while and then report how they did
+ * Call once all the threads have started. Returns early if one of signals arrives.
+ * \param seconds : How long to run for
+ * \param signals : The signals that stop vbit. They must be blocked.
+ * \param streamThread : The Stream thread
+ * \param outputThread : The OutputStream thread
+ */
+void benchRun(unsigned int seconds, sigset_t *signals, pthread_t streamThread, pthread_t outputThread);
+
+#endif
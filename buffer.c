@@ -48,61 +48,200 @@
 /**bufferInit
  * Sets up a packet buffer
  * \param bp - A bufferpacket control block
- * \param buf - The address of the packet buffer
- * \param len - The number of packets in the buffer
+ * \param slot - The address of the packet buffer
+ * \param len - The number of packets in the buffer. Rounded down to a power of two.
  */
-void bufferInit(bufferpacket *bp, char *buf, uint8_t len)
+void bufferInit(bufferpacket *bp, bufferslot *slot, unsigned int len)
 {
 #ifdef _DEBUG_
 fprintf(stderr,"[bufferInit] packets=%d\n",len);
 #endif 
+	while (len & (len-1))
+		len&=len-1;	// Clear the lowest bit until only one is left
 	bp->count=len;
-	bp->pkt=buf;
-	bp->head=0;
-	bp->tail=0;	
+	bp->mask=len-1;
+	bp->slot=slot;
+	atomic_init(&bp->head,0);
+	atomic_init(&bp->tail,0);
+	bp->tailCache=0;
+	bp->headCache=0;
+	atomic_init(&bp->waiters,0);
+	pthread_mutex_init(&bp->waitLock,NULL);
+	condInit(&bp->waitCond);
+}
+
+/**bufferWake
+ * Wake any thread blocked on this buffer. Called after head or tail moves.
+ * The fence pairs with the increment of waiters in bufferWait so that either
+ * we see the waiter or the waiter sees the packet that we just moved.
+ */
+static void bufferWake(bufferpacket *bp)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&bp->waiters,memory_order_relaxed))
+		return;	// The usual case. Nobody is waiting
+	pthread_mutex_lock(&bp->waitLock);
+	pthread_cond_broadcast(&bp->waitCond);
+	pthread_mutex_unlock(&bp->waitLock);
+}
+
+/**bufferReady
+ * \param space : 1 to test for room to put, 0 to test for a packet to get
+ * \return 1 if the wait is over
+ */
+static uint8_t bufferReady(bufferpacket *bp, uint8_t space)
+{
+	unsigned int level=atomic_load(&bp->head)-atomic_load(&bp->tail);
+	return space ? level<bp->count : level>0;
+}
+
+/**bufferWait
+ * Common part of bufferWaitData and bufferWaitSpace
+ * \return 1 if the wait is over, 0 if it timed out
+ */
+static uint8_t bufferWait(bufferpacket *bp, uint8_t space, unsigned int timeout)
+{
+	struct timespec when;
+	uint8_t ready;
+	if (bufferReady(bp,space))
+		return 1;	// No need to wait
+	condTimeout(&when,timeout);
+	atomic_fetch_add(&bp->waiters,1);
+	pthread_mutex_lock(&bp->waitLock);
+	if (!(ready=bufferReady(bp,space)))
+	{
+		// One wait is enough. A wakeup means that the buffer moved or bufferInterrupt was called.
+		pthread_cond_timedwait(&bp->waitCond,&bp->waitLock,&when);
+		ready=bufferReady(bp,space);
+	}
+	pthread_mutex_unlock(&bp->waitLock);
+	atomic_fetch_sub(&bp->waiters,1);
+	return ready;
+}
+
+void bufferInterrupt(bufferpacket *bp)
+{
+	pthread_mutex_lock(&bp->waitLock);
+	pthread_cond_broadcast(&bp->waitCond);
+	pthread_mutex_unlock(&bp->waitLock);
+}
+
+uint8_t bufferWaitData(bufferpacket *bp, unsigned int timeout)
+{
+	return bufferWait(bp,0,timeout) ? BUFFER_OK : BUFFER_EMPTY;
+}
+
+uint8_t bufferWaitSpace(bufferpacket *bp, unsigned int timeout)
+{
+	return bufferWait(bp,1,timeout) ? BUFFER_OK : BUFFER_FULL;
+}
+
+/** unreverse - Undo the bit reversal of a byte, if the hardware needs it
+ * \return The byte without its parity bit
+ */
+static uint8_t unreverse(uint8_t a)
+{
+#ifdef REVERSE	
+	a = (a & 0x0F) << 4 | (a & 0xF0) >> 4;
+	a = (a & 0x33) << 2 | (a & 0xCC) >> 2;
+	a = (a & 0x55) << 1 | (a & 0xAA) >> 1;	
+#endif
+	return a & 0x7f;	// mask the parity
+}
+
+void packetMetaDecode(packetmeta *meta, char *pkt)
+{
+	uint8_t a,b;
+	a=DehamTable[unreverse((uint8_t)pkt[3])];
+	b=DehamTable[unreverse((uint8_t)pkt[4])];
+	meta->created=micros();
+	meta->moved=0;
+	meta->mag=a & 0x07;
+	if (meta->mag==0) meta->mag=8;
+	meta->row=((a>>3) & 0x01) | ((b & 0x0f)<<1);
+	meta->flags=0;
+	meta->page=0;
+	if (!meta->row)
+	{
+		meta->flags=PACKETMETA_HEADER;
+		meta->page=(DehamTable[unreverse((uint8_t)pkt[6])] & 0x0f)<<4 | (DehamTable[unreverse((uint8_t)pkt[5])] & 0x0f);
+	}
 }
 
 /**bufferPut
  * \brief Put packet pkt onto bufferpacket bp.
+ * Only the producer thread may call this.
  * \param pkt : Packet to put
  * \param bp : buffer to put the packet onto
  * \return BUFFER_OK if OK BUFFER_FULL if full.
  */
 uint8_t bufferPut(bufferpacket *bp, char *pkt)
 {
-	int i;
-	char *p;
-	char *q;
-	if (bufferIsFull(bp)) return BUFFER_FULL;
-	p=bp->pkt+bp->head*PACKETSIZE;	// Destination
-	q=pkt;							// Source
-	// Copy the packet
-	for (i=0;i<PACKETSIZE;i++)
-		*p++=*q++;
-	// Update the head pointer	
-	bp->head=(bp->head+1) % bp->count;
+	packetmeta meta;
+	packetMetaDecode(&meta,pkt);
+	return bufferPutMeta(bp,pkt,&meta);
+}
+
+uint8_t bufferPutMeta(bufferpacket *bp, char *pkt, packetmeta *meta)
+{
+	bufferslot *slot;
+	unsigned int head=atomic_load_explicit(&bp->head,memory_order_relaxed);
+	if (head-bp->tailCache>=bp->count)
+	{
+		// Looks full. Has the consumer moved on since we last looked?
+		bp->tailCache=atomic_load_explicit(&bp->tail,memory_order_acquire);
+		if (head-bp->tailCache>=bp->count) return BUFFER_FULL;
+	}
+	slot=&bp->slot[head & bp->mask];
+	slot->meta=*meta;
+	memcpy(slot->packet,pkt,PACKETSIZE);
+	// Publish the packet to the consumer
+	atomic_store_explicit(&bp->head,head+1,memory_order_release);
+	bufferWake(bp);
 	return BUFFER_OK;
 }
 
 /**bufferGet
  * Get packet pkt from bufferpacket bp.
+ * Only the consumer thread may call this.
  * \param pkt : Packet to accept pop
  * \param bp : buffer to pop packet from
  * \return BUFFER_OK if OK BUFFER_EMPTY if empty.
  */
 uint8_t bufferGet(bufferpacket *bp, char *pkt)
 {
-	int i;
-	char *p;
-	char *q;
-	if (bufferIsEmpty(bp)) return BUFFER_EMPTY;	// Nothing to get? Return BUFFER_EMPTY (1)
-	p=bp->pkt+bp->tail*PACKETSIZE;	// Source
-	q=pkt;							// Destination
-	// Fetch the packet
-	for (i=0;i<PACKETSIZE;i++)
-		*q++=*p++;
-	// Step the tail pointer	
-	bp->tail=(bp->tail+1) % bp->count;
+	return bufferGetMeta(bp,pkt,NULL);
+}
+
+uint8_t bufferGetMeta(bufferpacket *bp, char *pkt, packetmeta *meta)
+{
+	bufferslot *slot;
+	unsigned int tail=atomic_load_explicit(&bp->tail,memory_order_relaxed);
+	if (bp->headCache==tail)
+	{
+		// Looks empty. Has the producer added anything since we last looked?
+		bp->headCache=atomic_load_explicit(&bp->head,memory_order_acquire);
+		if (bp->headCache==tail) return BUFFER_EMPTY;	// Nothing to get? Return BUFFER_EMPTY
+	}
+	slot=&bp->slot[tail & bp->mask];
+	if (meta)
+		*meta=slot->meta;
+	memcpy(pkt,slot->packet,PACKETSIZE);
+	// Hand the slot back to the producer
+	atomic_store_explicit(&bp->tail,tail+1,memory_order_release);
+	bufferWake(bp);
+	return BUFFER_OK;
+}
+
+uint8_t bufferPeekMeta(bufferpacket *bp, packetmeta *meta)
+{
+	unsigned int tail=atomic_load_explicit(&bp->tail,memory_order_relaxed);
+	if (bp->headCache==tail)
+	{
+		bp->headCache=atomic_load_explicit(&bp->head,memory_order_acquire);
+		if (bp->headCache==tail) return BUFFER_EMPTY;
+	}
+	*meta=bp->slot[tail & bp->mask].meta;
 	return BUFFER_OK;
 }
 
@@ -113,7 +252,8 @@ uint8_t bufferGet(bufferpacket *bp, char *pkt)
  */
 uint8_t bufferIsEmpty(bufferpacket *bp)
 {
-	if (bp->tail==bp->head) return BUFFER_EMPTY;		// head and tail are the same?
+	if (atomic_load_explicit(&bp->tail,memory_order_acquire)==atomic_load_explicit(&bp->head,memory_order_acquire))
+		return BUFFER_EMPTY;		// head and tail are the same?
 	return BUFFER_OK;
 }
 
@@ -124,19 +264,16 @@ uint8_t bufferIsEmpty(bufferpacket *bp)
  */
 uint8_t bufferIsFull(bufferpacket *bp)
 {
-	if (((bp->head+1) % bp->count) == bp->tail) return BUFFER_FULL; // Incrementing the head would hit the tail?
+	if (bufferLevel(bp)>=bp->count) return BUFFER_FULL; // No free slots?
 	return BUFFER_OK;
 }
 
 // What is this for? It will let stream work out what the next line is
 // and if it is on the next field.
-//... but this seems too complicated, Must be an easier way to maintain the line count
-uint8_t bufferLevel(bufferpacket *bp)
+unsigned int bufferLevel(bufferpacket *bp)
 {
-	if (bp->head>=bp->tail)
-		return (bp->head-bp->tail);
-	else
-		return (bp->count-bp->head+bp->tail);
+	unsigned int tail=atomic_load_explicit(&bp->tail,memory_order_acquire);
+	return atomic_load_explicit(&bp->head,memory_order_acquire)-tail;
 }
 
  /** buffermove
@@ -144,231 +281,34 @@ uint8_t bufferLevel(bufferpacket *bp)
   * This is used to multiplex mag to stream.
   * \param dest Destination buffer
   * \param src Source buffer
+  * \param flags PACKETMETA_ flags to add to the packet
   * \return BUFFER_OK=OK, BUFFER_HEADER=header, BUFFER_FULL=destination full, BUFFER_EMPTY=source empty
-  * We do some stupid stuff: decoding packets that we only coded a fraction of a second ago
-  * mainly because we don't pass any other data between threads.
+  * The packet descriptor travels with the packet, so there is no need to decode it here.
   */
-uint8_t bufferMove(bufferpacket *dest, bufferpacket *src)
+uint8_t bufferMove(bufferpacket *dest, bufferpacket *src, uint8_t flags)
 {
-	char a,b; /// Temporary stores to help reverse bytes if the transmission hardware requires it (Vbit-Pi inserter needs reverse. VBIT-Pi-Stream does not.)
-	uint8_t row;
 	uint8_t returnCode=BUFFER_OK;
 	char pkt[PACKETSIZE];
-	uint8_t i;
-	// uint8_t c;
-	time_t timer;
-	char str[9];
-	struct tm * timeinfo;
-	char* ptr;
-	char * ptr2;
-	uint8_t mag;
+	packetmeta meta;
 	
 	if (bufferIsFull(dest))	// Quit if destination is full
 		return BUFFER_FULL;
-	if (bufferGet(src,pkt)==BUFFER_EMPTY)	// Quit if source is empty
+	if (bufferGetMeta(src,pkt,&meta)==BUFFER_EMPTY)	// Quit if source is empty
 		return BUFFER_EMPTY;
 	
-	// Test if MRAG is an header
-	// So decode the packet.
-	// reverse the bit order
-	a =(uint8_t)pkt[3];
-#ifdef REVERSE	
-	a = (a & 0x0F) << 4 | (a & 0xF0) >> 4;
-	a = (a & 0x33) << 2 | (a & 0xCC) >> 2;
-	a = (a & 0x55) << 1 | (a & 0xAA) >> 1;	
-#endif
-	// mask the parity
-	a &= 0x7f;
-	// and deham the result
-	a=DehamTable[(uint8_t)a];
-	mag=a;
-	if (mag==0) mag=8;
-	
-	// And again for the next byte
-	b =(uint8_t)pkt[4];
-#ifdef REVERSE
-	b = (b & 0x0F) << 4 | (b & 0xF0) >> 4;
-	b = (b & 0x33) << 2 | (b & 0xCC) >> 2;
-	b = (b & 0x55) << 1 | (b & 0xAA) >> 1;	
-#endif
-	// mask the parity
-	b &= 0x7f;
-	// and deham the result
-	b=DehamTable[(uint8_t)b];
-	row=a & 0x08;
-	row+=b;
-	
-	// If the row is 0, return the fact that it is an header
+	// If it is a header, return the fact that it is an header
 	// In addition put in all the dynamic elements
-	if (!row)	// Format the header here
+	if (meta.flags & PACKETMETA_HEADER)	// Format the header here
 	{
-		// What is the header?
-		// Four blanks, three page digits, another blank, and 32 chars of data. The last 8 digits are for the clock but this seems to be convention.
-		// Insert page number, date, clock
-		// "mpp MRG DAY dd MTH"
-		// HERE WE TRANSLATE ALL THE HEADER BITS
-		
-		/* TODO: format the template
-		p=strstr(packet,"mpp"); 
-		if (p) // if we have mpp, replace it with the actual page number...
-		{
-			*p++=mag+'0';
-			ch=page>>4; // page tens (note wacky way of converting digit to hex)
-			*p++=ch+(ch>9?'7':'0');
-			ch=page%0x10; // page units
-			*p++=ch+(ch>9?'7':'0');
-		}		
-*/		
-		// What are we going to write? The last 32 bytes of the header. The first 8 bytes are for control flags and stuff.
-		// Fill the buffer with dummy data. Trust me. It will help with debugging.
-		ptr=&pkt[PACKETSIZE-32];
-		ptr2=headerTemplate;
-		
-		for (i=0;i<32;i++)
-			// *ptr++=i+'0';	// Copy pattern	
-			*ptr++=*ptr2++;		// Copy the built in template
-	
-		ptr=&pkt[PACKETSIZE-32];	// Reset the packet pointer
-		// Do substitutions. Only allow each one once per header
-		// MPP - Magazine and page number
-		
-		ptr2=strstr(ptr,"%%#");
-		
-		if (ptr2)
-		{
-		
-			//ptr2[0]=(a & 0x07)+'1';	// Mag
-			ptr2[0]=(mag & 0x0f)+'0';	// Mag
-			// ptr2[3]=((mag & 0xf0)>>4) + 'a'; // temp
-			a =(uint8_t)pkt[6];
-#ifdef REVERSE			
-			a = (a & 0x0F) << 4 | (a & 0xF0) >> 4;
-			a = (a & 0x33) << 2 | (a & 0xCC) >> 2;
-			a = (a & 0x55) << 1 | (a & 0xAA) >> 1;	
-#endif
-			// mask the parity
-			a &= 0x7f;			
-			ptr2[1]=(DehamTable[(uint8_t)a]&0x0f)+'0'; 	// Page (ten)
-			if (ptr2[1]>'9')
-				ptr2[1]=ptr2[1]-'0'-10+'A'; 	// Particularly poor hex conversion algorithm
-
-			a =(uint8_t)pkt[5];
-#ifdef REVERSE
-			a = (a & 0x0F) << 4 | (a & 0xF0) >> 4;
-			a = (a & 0x33) << 2 | (a & 0xCC) >> 2;
-			a = (a & 0x55) << 1 | (a & 0xAA) >> 1;	
-#endif			
-			// mask the parity
-			a &= 0x7f;			
-			ptr2[2]=(DehamTable[(uint8_t)a]&0x0f)+'0';	// Page (unit)
-			if (ptr2[2]>'9')
-				ptr2[2]=ptr2[2]-'0'-10+'A'; 	// Particularly poor hex conversion algorithm
-			
-			// TEST
-			b =(uint8_t)pkt[3];
-#ifdef REVERSE
-			b = (b & 0x0F) << 4 | (b & 0xF0) >> 4;
-			b = (b & 0x33) << 2 | (b & 0xCC) >> 2;
-			b = (b & 0x55) << 1 | (b & 0xAA) >> 1;	
-#endif			
-			b&=0x7f;
-			// c=DehamTable[(uint8_t) b];
-			// printf("ptr[3]=%02x Rev=%02x mag=%02x mag=%02x. ",pkt[3],b,c,mag);
-		}
-		
-		timer=time(NULL);
-		timeinfo=localtime(&timer);	// This gets local time.
-
-		ptr2=strstr(ptr,"%%a");	// Tue
-		if (ptr2)
-		{
-			strftime(str,10,"%a",timeinfo);
-			ptr2[0]=str[0];
-			ptr2[1]=str[1];
-			ptr2[2]=str[2];
-		}
-			
-		ptr2=strstr(ptr,"%%b"); // Jan
-		if (ptr2)
-		{
-			strftime(str,10,"%b",timeinfo);
-			ptr2[0]=str[0];
-			ptr2[1]=str[1];
-			ptr2[2]=str[2];
-		}
-		
-		ptr2=strstr(ptr,"%d");	// day of month with leading zero
-		if (ptr2)
-		{
-			strftime(str,10,"%d",timeinfo);
-			ptr2[0]=str[0];
-			ptr2[1]=str[1];
-		}
-		
-		ptr2=strstr(ptr,"%e");	// day of month with no leading zero
-		if (ptr2)
-		{
-			#ifndef WIN32
-			strftime(str,10,"%e",timeinfo);
-			ptr2[0]=str[0];
-			#else
-			strftime(str,10,"%d",timeinfo); // mingw doesn't know %e
-			if (str[0] == '0')
-				ptr2[0]=' ';
-			else
-				ptr2[0]=str[0];
-			#endif
-			ptr2[1]=str[1];
-		}		
-
-		ptr2=strstr(ptr,"%m");	// month number with leading 0
-		if (ptr2)
-		{
-			strftime(str,10,"%m",timeinfo);
-			ptr2[0]=str[0];
-			ptr2[1]=str[1];
-		}		
-
-		ptr2=strstr(ptr,"%y");	// year. 2 digits
-		if (ptr2)
-		{
-			strftime(str,10,"%y",timeinfo);
-			ptr2[0]=str[0];
-			ptr2[1]=str[1];
-		}
-		
-		ptr2=strstr(ptr,"%H");	// hour.
-		if (ptr2)
-		{
-			strftime(str,10,"%H",timeinfo);
-			ptr2[0]=str[0];
-			ptr2[1]=str[1];
-		}
-		
-		ptr2=strstr(ptr,"%M");	// minutes.
-		if (ptr2)
-		{
-			strftime(str,10,"%M",timeinfo);
-			ptr2[0]=str[0];
-			ptr2[1]=str[1];
-		}
-		
-		ptr2=strstr(ptr,"%S");	// seconds.
-		if (ptr2)
-		{
-			strftime(str,10,"%S",timeinfo);
-			ptr2[0]=str[0];
-			ptr2[1]=str[1];
-		}
-
-		Parity(pkt,13);
-		
+		// The last 32 bytes of the header: page, date, clock etc. The first 8 bytes are for control flags and stuff.
+		headerRender(pkt,meta.mag,meta.page);
 		returnCode=BUFFER_HEADER;	// Signal that this is a mag header
 	}	
 	
 	// Finally send this buffer to the output stream
-	bufferPut(dest,pkt);
+	meta.moved=micros();	// The end of the wait in the magazine buffer
+	meta.flags|=flags;
+	bufferPutMeta(dest,pkt,&meta);
 
 	return returnCode;
 }
-  
@@ -9,11 +9,17 @@
  */
  
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
 
 #include "settings.h"
+#include "delay.h"
 
 #include "packet.h"
+#include "header.h"
 // Buffer structures are first packet, last packet, head and tail index
 // Access methods init, push, pop, isempty,isfull
 
@@ -26,17 +32,68 @@
 //#define BUFFER_DESTINATION_FULL 4
 //#define BUFFER_SOURCE_EMPTY 4
 
+/** Packet descriptor
+ * Travels with each packet through the buffers so that nothing downstream
+ * has to deham the packet to find out what it is.
+ */
+typedef struct _packetmeta_
+{
+	uint64_t created;	/// micros() when the packet was made. For latency tracing.
+	uint64_t moved;		/// micros() when bufferMove put it on the stream buffer
+	uint8_t mag;		/// Magazine 1..8
+	uint8_t row;		/// Row 0..31
+	uint8_t page;		/// Page number of a header
+	uint8_t flags;		/// PACKETMETA_ values
+} packetmeta;
+
+// packetmeta flags
+#define PACKETMETA_HEADER 0x01	// A header that needs the template filling in
+#define PACKETMETA_QUIET 0x02	// A quiet or filler line, not a real packet
+#define PACKETMETA_SUBTITLE 0x04	// A Newfor subtitle. created is when it went on air.
+#define PACKETMETA_SERVICE 0x08	// Made by stream.c, eg. packet 8/30
+#define PACKETMETA_FIELDSTART 0x10	// The first line of a field, as stream.c counts them
+#define PACKETMETA_EVEN 0x20	// With PACKETMETA_FIELDSTART. The field was made for the even field line map.
+
+/** One slot of a buffer. The packet and its descriptor.
+ */
+typedef struct _bufferslot_
+{
+	packetmeta meta;
+	char packet[PACKETSIZE];
+} bufferslot;
+
+// Size of a cache line. The producer and consumer ends of a buffer are kept on separate lines.
+#define BUFFER_CACHELINE 64
+
 /** buffer control block
  * Contains all the data needed for a circular buffer of packets
  * All units are packet counts, not addresses
  * There is one buffer for the stream.c packet multiplexer with at least a fields worth of packets.
  * and one buffer for each magazine with enough storage for a ttx page.
+ *
+ * Each buffer is lock free with exactly one thread putting and one thread getting.
+ * head and tail run freely and are masked to find the slot, so head-tail is the level.
+ * Each end keeps a cached copy of the other end's index so that it only
+ * has to read the other thread's cache line when the buffer looks full or empty.
+ *
+ * A thread that has nothing to do can block in bufferWaitData or bufferWaitSpace.
+ * bufferPut and bufferGet only touch the wait lock when somebody is waiting.
  */
 typedef struct  {
-	char* pkt;			// The address of the packet buffer. (This must be allocated separately)
-	uint8_t count;		// The total number of packets in that buffer
-	uint8_t head;		// The head of the buffer (next to push)
-	uint8_t tail;		// Tail of the buffer (next to pop)
+	// Set up by bufferInit and then only read
+	_Alignas(BUFFER_CACHELINE) bufferslot* slot;	// The address of the packet buffer. (This must be allocated separately)
+	unsigned int count;		// The total number of packets in that buffer. A power of two.
+	unsigned int mask;		// count-1
+	// Producer end
+	_Alignas(BUFFER_CACHELINE) atomic_uint head;	// The head of the buffer (next to push)
+	unsigned int tailCache;	// The producer's last look at tail
+	// Consumer end
+	_Alignas(BUFFER_CACHELINE) atomic_uint tail;	// Tail of the buffer (next to pop)
+	unsigned int headCache;	// The consumer's last look at head
+	// Blocking waits
+	_Alignas(BUFFER_CACHELINE) atomic_uint waiters;	// Number of threads in bufferWaitData or bufferWaitSpace
+	pthread_mutex_t waitLock;
+	pthread_cond_t waitCond;	// Signalled when a packet is put or got while someone waits
 } bufferpacket;
 
 /* meta packet values */
@@ -49,19 +106,29 @@ typedef struct  {
 /**bufferInit
  * Sets up a packet buffer
  * \param bp - A bufferpacket control block
- * \param buf - The address of the packet buffer
- * \param len - The number of packets in the buffer
+ * \param slot - The address of the packet buffer
+ * \param len - The number of packets in the buffer. This should be a power of two. If not, it is rounded down to one.
  */
-void bufferInit(bufferpacket *bp, char *buf, uint8_t len);
+void bufferInit(bufferpacket *bp, bufferslot *slot, unsigned int len);
 
 /**bufferPut
  * Push packet pkt onto bufferpacket bp.
+ * The descriptor is decoded from the packet. Use bufferPutMeta if you already know it.
  * \param pkt : Packet to push
  * \param bp : buffer to push the packet onto
  * \return 0 if OK 1 if full.
  */
 uint8_t bufferPut(bufferpacket *bp, char *pkt);
 
+/**bufferPutMeta
+ * Push packet pkt and its descriptor onto bufferpacket bp.
+ * \param pkt : Packet to push
+ * \param meta : What the packet is
+ * \param bp : buffer to push the packet onto
+ * \return BUFFER_OK or BUFFER_FULL
+ */
+uint8_t bufferPutMeta(bufferpacket *bp, char *pkt, packetmeta *meta);
+
 /**bufferGet
  * Get packet pkt from the tail of bufferpacket bp.
  * \param pkt : Packet to accept pop
@@ -70,6 +137,32 @@ uint8_t bufferPut(bufferpacket *bp, char *pkt);
  */
 uint8_t bufferGet(bufferpacket *bp, char *pkt);
 
+/**bufferGetMeta
+ * Get packet pkt and its descriptor from the tail of bufferpacket bp.
+ * \param pkt : Packet to accept pop
+ * \param meta : Receives the descriptor
+ * \param bp : buffer to pop packet from
+ * \return BUFFER_OK or BUFFER_EMPTY
+ */
+uint8_t bufferGetMeta(bufferpacket *bp, char *pkt, packetmeta *meta);
+
+/**bufferPeekMeta
+ * Look at the descriptor of the packet at the tail of bufferpacket bp without taking it.
+ * Only the consumer may call this.
+ * \param meta : Receives the descriptor
+ * \param bp : buffer to look at
+ * \return BUFFER_OK or BUFFER_EMPTY
+ */
+uint8_t bufferPeekMeta(bufferpacket *bp, packetmeta *meta);
+
+/**packetMetaDecode
+ * Work out the descriptor of a packet from its MRAG and page bytes.
+ * Only for packets that come from somewhere that doesn't know, such as Newfor.
+ * \param meta : Result
+ * \param pkt : A packet
+ */
+void packetMetaDecode(packetmeta *meta, char *pkt);
+
 /**bufferIsEmpty
  * Test whether a buffer is empty
  * \param bp : buffer to test
@@ -84,6 +177,29 @@ uint8_t bufferIsEmpty(bufferpacket *bp);
  */
 uint8_t bufferIsFull(bufferpacket *bp);
 
+/**bufferWaitData
+ * Block the consumer until there is a packet to get
+ * \param bp : buffer to wait on
+ * \param timeout : Longest wait in milliseconds
+ * \return BUFFER_OK if there is a packet, BUFFER_EMPTY if it timed out or was interrupted
+ */
+uint8_t bufferWaitData(bufferpacket *bp, unsigned int timeout);
+
+/**bufferWaitSpace
+ * Block the producer until there is room to put a packet
+ * \param bp : buffer to wait on
+ * \param timeout : Longest wait in milliseconds
+ * \return BUFFER_OK if there is room, BUFFER_FULL if it timed out or was interrupted
+ */
+uint8_t bufferWaitSpace(bufferpacket *bp, unsigned int timeout);
+
+/**bufferInterrupt
+ * Wake any thread blocked in bufferWaitData or bufferWaitSpace
+ * Used at shutdown so that nobody sits out the rest of their timeout.
+ * \param bp : buffer to wake
+ */
+void bufferInterrupt(bufferpacket *bp);
+
 /** buffermove
  * Pops from buffer b2 and pushes to b1
  * This might be handy where it comes to multiplexing mag to stream.
@@ -93,14 +209,15 @@ uint8_t bufferIsFull(bufferpacket *bp);
   * This might be handy where it comes to multiplexing mag to stream.
   * \param b1 Destination buffer
   * \param b2 Source buffer
+  * \param flags PACKETMETA_ flags to add to the packet, eg. PACKETMETA_FIELDSTART
   * \return 0=OK, 1=failed 2=header
   */
-uint8_t bufferMove(bufferpacket *b1, bufferpacket *b2);
+uint8_t bufferMove(bufferpacket *b1, bufferpacket *b2, uint8_t flags);
 
 /** bufferLevel - Used to work out approximately what line we are on
  * \return The number of packets in the buffer
  */
-uint8_t bufferLevel(bufferpacket *bp);
+unsigned int bufferLevel(bufferpacket *bp);
 
 
 
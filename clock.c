@@ -0,0 +1,113 @@
+/** ***************************************************************************
+ * Name				: clock.c
+ * Description       : VBIT Time service
+ * Works out the time once a second and publishes it through a sequence
+ * lock for the header, packet 8/30 and row token code.
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+
+#include "clock.h"
+
+static CLOCKSNAP snapshot;	/// The published time
+static atomic_uint snapSeq;	/// Odd while snapshot is being written
+static atomic_llong snapNow;	/// snapshot.now for clockNow
+static uint64_t nextSecond;	/// millis() when the wall clock next ticks over
+
+/** readClock - Do all the conversions for the current second and publish them
+ */
+static void readClock(void)
+{
+	CLOCKSNAP s;
+	struct timespec ts;
+	struct tm tmp;
+	time_t timeLocal;
+	time_t timeUTC;
+	#ifndef WIN32
+	clock_gettime(CLOCK_REALTIME,&ts);
+	#else
+	ts.tv_sec=time(NULL);
+	ts.tv_nsec=0;
+	#endif
+	s.now=ts.tv_sec;
+	s.local=*localtime(&s.now);
+	s.utc=*gmtime(&s.now);
+
+	/* calculate number of seconds local time is offset from UTC */
+	tmp=s.local;
+	timeLocal=mktime(&tmp);
+	tmp=s.utc;
+	timeUTC=mktime(&tmp);
+	s.offsetHalfHours=difftime(timeLocal,timeUTC)/1800;
+
+	s.mjd=calculateMJD(s.utc.tm_year+1900,s.utc.tm_mon+1,s.utc.tm_mday);
+	strftime(s.timedate,sizeof(s.timedate),"\x02%a %d %b\x03%H:%M/%S",&s.local);
+
+	// The readers retry if the count is odd or changes while they copy
+	atomic_fetch_add_explicit(&snapSeq,1,memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	snapshot=s;
+	atomic_fetch_add_explicit(&snapSeq,1,memory_order_release);
+	atomic_store_explicit(&snapNow,s.now,memory_order_release);
+
+	// Look again when the wall clock should have moved on. A little late is better than early.
+	nextSecond=millis()+1000-ts.tv_nsec/1000000;
+} // readClock
+
+void clockInit(void)
+{
+	readClock();
+}
+
+void clockTick(void)
+{
+	if (millis()<nextSecond)
+		return;
+	if (time(NULL)==clockNow())
+		nextSecond=millis()+1;	// Not quite there yet
+	else
+		readClock();
+}
+
+time_t clockNow(void)
+{
+	return atomic_load_explicit(&snapNow,memory_order_acquire);
+}
+
+void clockGet(CLOCKSNAP *snap)
+{
+	unsigned int seq;
+	do
+	{
+		seq=atomic_load_explicit(&snapSeq,memory_order_acquire);
+		*snap=snapshot;
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) || seq!=atomic_load_explicit(&snapSeq,memory_order_relaxed));
+}
+
+double calculateMJD(int year, int month, int day){
+	// calculate modified julian day number
+	int a, m, y;
+	a = (14 - month) / 12;
+	y = year + 4800 - a;
+	m = month + (12 * a) - 3;
+	return day + ((153 * m + 1)/5) + (365 * y) + (y / 4) - (y / 100) + (y / 400) - 32045 - 2400000.5;
+}
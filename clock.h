@@ -0,0 +1,83 @@
+/** ***************************************************************************
+ * Description       : VBIT Time service
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "delay.h"
+
+/** The time as everything that goes on air sees it.
+ * Headers, packet 8/30 and the row tokens all want the time in one form or
+ * another. Rather than each of them calling the C library for every packet,
+ * the stream thread ticks the clock once per field and the conversions are
+ * only done when the second changes. Every packet in a field shows the same time.
+ */
+typedef struct _CLOCKSNAP_
+{
+	time_t now;				/// Seconds since the epoch
+	struct tm local;		/// Local time
+	struct tm utc;			/// UTC
+	int offsetHalfHours;	/// Local time minus UTC in half hours
+	long mjd;				/// Modified Julian Day of the UTC date
+	char timedate[21];		/// The %%%%%%%%%%%%timedate token, eg. "\x02Sat 17 Oct\x0315:49/36"
+} CLOCKSNAP;
+
+/** clockInit - Read the time for the first time
+ * Call before any thread that uses the clock starts.
+ */
+void clockInit(void);
+
+/** clockTick - Move the clock on
+ * Called by the stream thread at the start of every field. The system clock
+ * is only looked at when the monotonic clock says that a second has gone by.
+ * Only one thread may call this.
+ */
+void clockTick(void);
+
+/** clockNow - The second that the clock is showing
+ * Cheap enough to compare against on every packet.
+ * \return Seconds since the epoch
+ */
+time_t clockNow(void);
+
+/** clockGet - Copy the current time snapshot
+ * \param snap : Receives the snapshot
+ */
+void clockGet(CLOCKSNAP *snap);
+
+/** calculateMJD - Modified Julian Day of a date
+ * \param year : eg. 2015
+ * \param month : 1..12
+ * \param day : 1..31
+ */
+double calculateMJD(int year, int month, int day);
+
+#endif
@@ -16,3 +16,87 @@ void delay (unsigned int howLong)
   nanosleep (&sleeper, &dummy) ;
 }
 
+/*
+ * delayUntil:
+ *	Wait until the monotonic clock reaches an absolute time, so that
+ *	a run of waits doesn't drift.
+ *********************************************************************************
+ */
+void delayUntil (uint64_t when)
+{
+#ifndef WIN32
+  struct timespec sleeper ;
+
+  sleeper.tv_sec  = (time_t)(when / 1000000) ;
+  sleeper.tv_nsec = (long)(when % 1000000) * 1000 ;
+
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &sleeper, NULL) == EINTR)
+    ;
+#else
+  uint64_t now = micros () ;
+
+  if (when > now)
+    delay ((unsigned int)((when - now + 999) / 1000)) ;
+#endif
+}
+
+
+/*
+ * millis: micros:
+ *	Return the monotonic clock in milliseconds or microseconds.
+ *	Not affected by changes to the system clock.
+ *********************************************************************************
+ */
+uint64_t millis (void)
+{
+  struct timespec now ;
+
+  clock_gettime (CLOCK_MONOTONIC, &now) ;
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 ;
+}
+
+uint64_t micros (void)
+{
+  struct timespec now ;
+
+  clock_gettime (CLOCK_MONOTONIC, &now) ;
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 ;
+}
+
+/*
+ * condInit: condTimeout:
+ *	Condition variables that time out on the monotonic clock.
+ *	The Windows pthreads only have the real time clock.
+ *********************************************************************************
+ */
+
+#ifndef WIN32
+#define COND_CLOCK CLOCK_MONOTONIC
+#else
+#define COND_CLOCK CLOCK_REALTIME
+#endif
+
+int condInit (pthread_cond_t *cond)
+{
+  pthread_condattr_t attr ;
+  int result ;
+  pthread_condattr_init (&attr) ;
+#ifndef WIN32
+  pthread_condattr_setclock (&attr, COND_CLOCK) ;
+#endif
+  result = pthread_cond_init (cond, &attr) ;
+  pthread_condattr_destroy (&attr) ;
+  return result ;
+}
+
+void condTimeout (struct timespec *when, unsigned int howLong)
+{
+  clock_gettime (COND_CLOCK, when) ;
+  when->tv_sec  += (time_t)(howLong / 1000) ;
+  when->tv_nsec += (long)(howLong % 1000) * 1000000 ;
+  if (when->tv_nsec >= 1000000000)
+  {
+    when->tv_sec++ ;
+    when->tv_nsec -= 1000000000 ;
+  }
+}
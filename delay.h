@@ -6,4 +6,34 @@
  *********************************************************************************
  */
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
 extern void         delay             (unsigned int howLong) ;
+
+/*
+ * delayUntil:
+ *	Wait until micros() reaches when. Returns at once if it already has.
+ *********************************************************************************
+ */
+extern void         delayUntil        (uint64_t when) ;
+
+/*
+ * millis: micros:
+ *	Monotonic time since some unspecified starting point.
+ *	Not affected by changes to the system clock.
+ *********************************************************************************
+ */
+extern uint64_t     millis            (void) ;
+extern uint64_t     micros            (void) ;
+
+/*
+ * condInit: condTimeout:
+ *	Condition variables whose timeouts run on the same clock as millis,
+ *	so that waits are not upset by changes to the system clock.
+ *	condTimeout sets the absolute time howLong milliseconds from now,
+ *	ready for pthread_cond_timedwait.
+ *********************************************************************************
+ */
+extern int          condInit          (pthread_cond_t *cond) ;
+extern void         condTimeout       (struct timespec *when, unsigned int howLong) ;
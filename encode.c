@@ -0,0 +1,119 @@
+/** ***************************************************************************
+ * Name				: encode.c
+ * Description       : VBIT Block encoders for parity and Hamming codes
+ * Every text row gets parity on up to 40 bytes and every header, link and
+ * 8/30 packet is mostly Hamming 8/4 bytes. These do a whole run at once.
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+
+#include "encode.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ENCODE_NEON
+#endif
+
+void ParityEncode(uint8_t *p, unsigned int n)
+{
+	unsigned int i=0;
+#if defined(__SSE2__)
+	const __m128i low7=_mm_set1_epi8(0x7f);
+	const __m128i low4=_mm_set1_epi8(0x0f);
+	const __m128i low2=_mm_set1_epi8(0x03);
+	const __m128i one=_mm_set1_epi8(0x01);
+	const __m128i top=_mm_set1_epi8((char)0x80);
+	__m128i x,t;
+	for (;i+16<=n;i+=16)
+	{
+		x=_mm_and_si128(_mm_loadu_si128((__m128i*)(p+i)),low7);
+		// Fold the bits down to bit 0. There are no byte shifts, so mask off what comes from the next byte
+		t=_mm_xor_si128(x,_mm_and_si128(_mm_srli_epi16(x,4),low4));
+		t=_mm_xor_si128(t,_mm_and_si128(_mm_srli_epi16(t,2),low2));
+		t=_mm_xor_si128(t,_mm_and_si128(_mm_srli_epi16(t,1),one));
+		// An even number of ones needs the parity bit
+		t=_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(t,one),_mm_setzero_si128()),top);
+		_mm_storeu_si128((__m128i*)(p+i),_mm_or_si128(x,t));
+	}
+#elif defined(ENCODE_NEON)
+	const uint8x16_t low7=vdupq_n_u8(0x7f);
+	const uint8x16_t one=vdupq_n_u8(0x01);
+	const uint8x16_t top=vdupq_n_u8(0x80);
+	uint8x16_t x,t;
+	for (;i+16<=n;i+=16)
+	{
+		x=vandq_u8(vld1q_u8(p+i),low7);
+		t=vandq_u8(vcntq_u8(x),one);	// 1 if the count of ones is odd
+		t=vandq_u8(vceqq_u8(t,vdupq_n_u8(0)),top);
+		vst1q_u8(p+i,vorrq_u8(x,t));
+	}
+#endif
+	for (;i<n;i++)
+		p[i]=ParTab[p[i]&0x7f];
+}
+
+void HamEncode(uint8_t *dst, const uint8_t *nibbles, unsigned int n)
+{
+	unsigned int i=0;
+#if defined(__SSSE3__)
+	const __m128i table=_mm_loadu_si128((const __m128i*)HamTab);
+	const __m128i low4=_mm_set1_epi8(0x0f);
+	for (;i+16<=n;i+=16)
+		_mm_storeu_si128((__m128i*)(dst+i),
+			_mm_shuffle_epi8(table,_mm_and_si128(_mm_loadu_si128((const __m128i*)(nibbles+i)),low4)));
+#elif defined(ENCODE_NEON) && defined(__aarch64__)
+	const uint8x16_t table=vld1q_u8((const uint8_t*)HamTab);
+	const uint8x16_t low4=vdupq_n_u8(0x0f);
+	for (;i+16<=n;i+=16)
+		vst1q_u8(dst+i,vqtbl1q_u8(table,vandq_u8(vld1q_u8(nibbles+i),low4)));
+#endif
+	for (;i<n;i++)
+		dst[i]=HamTab[nibbles[i]&0x0f];
+}
+
+void Ham24Encode(uint8_t *dst, const unsigned int *triplets, unsigned int n)
+{
+	// vbi_ham24p is already three table lookups per triplet. Nothing to gain from SIMD here.
+	unsigned int i;
+	for (i=0;i<n;i++)
+		vbi_ham24p(dst+3*i,triplets[i]);
+}
+
+const char *EncodeKernel(void)
+{
+#if defined(__SSSE3__)
+	return "SSSE3";
+#elif defined(__SSE2__)
+	return "SSE2";
+#elif defined(ENCODE_NEON) && defined(__aarch64__)
+	return "NEON (AArch64)";
+#elif defined(ENCODE_NEON)
+	return "NEON";
+#else
+	return "scalar";
+#endif
+}
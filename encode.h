@@ -0,0 +1,64 @@
+/** ***************************************************************************
+ * Description       : VBIT Block encoders for parity and Hamming codes
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+#ifndef _ENCODE_H_
+#define _ENCODE_H_
+
+#include <stdint.h>
+
+#include "tables.h"
+#include "hamm.h"
+
+/** These work on a run of bytes at a time.
+ * Where the compiler offers SSE2/SSSE3 or NEON they do 16 bytes per step,
+ * otherwise they fall back to the tables one byte at a time.
+ * The results are identical either way.
+ */
+
+/** ParityEncode - Add odd parity to a run of characters, in place
+ * Bit 7 of each input is ignored.
+ * \param p : The characters
+ * \param n : How many
+ */
+void ParityEncode(uint8_t *p, unsigned int n);
+
+/** HamEncode - Hamming 8/4 encode a run of nibbles
+ * \param dst : n encoded bytes
+ * \param nibbles : n values. Only the low four bits are used.
+ * \param n : How many
+ */
+void HamEncode(uint8_t *dst, const uint8_t *nibbles, unsigned int n);
+
+/** Ham24Encode - Hamming 24/18 encode a run of triplets
+ * \param dst : 3*n encoded bytes
+ * \param triplets : n 18 bit values
+ * \param n : How many
+ */
+void Ham24Encode(uint8_t *dst, const unsigned int *triplets, unsigned int n);
+
+/** EncodeKernel - Name of the instruction set that the encoders were built for
+ */
+const char *EncodeKernel(void);
+
+#endif
@@ -0,0 +1,149 @@
+/** ***************************************************************************
+ * Name				: header.c
+ * Description       : VBIT Header template
+ * The header template is parsed once into a list of the places that
+ * change. The time fields are formatted once a second and every header
+ * in between only has to copy them and add its page number.
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+
+#include "header.h"
+
+/** The codes that we know about, in the order that they are looked for
+ */
+typedef struct _HEADERCODE_
+{
+	const char *code;	/// What to look for in the template
+	const char *format;	/// strftime format of the replacement. NULL for the page number
+	uint8_t length;		/// Number of characters replaced
+} HEADERCODE;
+
+static const HEADERCODE headerCodes[]=
+{
+	{"%%#",NULL,3},
+	{"%%a","%a",3},
+	{"%%b","%b",3},
+	{"%d","%d",2},
+	{"%e","%e",2},
+	{"%m","%m",2},
+	{"%y","%y",2},
+	{"%H","%H",2},
+	{"%M","%M",2},
+	{"%S","%S",2}
+};
+
+#define HEADERCODES (sizeof(headerCodes)/sizeof(HEADERCODE))
+
+/** A code found in the template
+ */
+typedef struct _HEADERFIELD_
+{
+	uint8_t offset;	/// Where it is in the template
+	const HEADERCODE *code;
+} HEADERFIELD;
+
+static char headerText[HEADERLENGTH];	/// The template
+static HEADERFIELD headerField[HEADERCODES];	/// The time codes in the template
+static uint8_t headerFields;	/// Number of entries in headerField
+static int pageOffset=-1;	/// Where the page number goes, or -1 if it doesn't
+
+static char rendered[HEADERLENGTH];	/// The template with the time filled in and parity added
+static time_t renderedTime=-1;	/// The second that rendered is for
+
+void headerCompile(char *template)
+{
+	char work[HEADERLENGTH+1];
+	char *p;
+	unsigned int i;
+	memcpy(headerText,template,HEADERLENGTH);
+	memcpy(work,template,HEADERLENGTH);
+	work[HEADERLENGTH]=0;
+	headerFields=0;
+	pageOffset=-1;
+	for (i=0;i<HEADERCODES;i++)
+	{
+		p=strstr(work,headerCodes[i].code);
+		if (!p)
+			continue;
+		// Blank it out in case it forms part of a later code, just like the real text would
+		memset(p,' ',headerCodes[i].length);
+		if (!headerCodes[i].format)
+			pageOffset=p-work;
+		else
+		{
+			headerField[headerFields].offset=p-work;
+			headerField[headerFields++].code=&headerCodes[i];
+		}
+	}
+	renderedTime=-1;	// Make sure that the next header uses the new template
+} // headerCompile
+
+/** renderTime - Make a copy of the template with the time filled in
+ */
+static void renderTime(void)
+{
+	CLOCKSNAP clock;
+	struct tm *timeinfo=&clock.local;
+	char str[10];
+	uint8_t i;
+	memcpy(rendered,headerText,HEADERLENGTH);
+	clockGet(&clock);
+	for (i=0;i<headerFields;i++)
+	{
+		#ifdef WIN32
+		if (headerField[i].code->format[1]=='e')
+		{
+			strftime(str,10,"%d",timeinfo); // mingw doesn't know %e
+			if (str[0]=='0')
+				str[0]=' ';
+		}
+		else
+		#endif
+		strftime(str,10,headerField[i].code->format,timeinfo);
+		memcpy(&rendered[headerField[i].offset],str,headerField[i].code->length);
+	}
+	ParityEncode((uint8_t*)rendered,HEADERLENGTH);
+	renderedTime=clock.now;
+} // renderTime
+
+/** hexDigit - One digit of a page number with parity
+ */
+static char hexDigit(uint8_t n)
+{
+	n&=0x0f;
+	return ParTab[n+(n>9 ? 'A'-10 : '0')];
+}
+
+void headerRender(char *pkt, uint8_t mag, uint8_t page)
+{
+	char *ptr=&pkt[PACKETSIZE-HEADERLENGTH];
+	if (clockNow()!=renderedTime)
+		renderTime();
+	memcpy(ptr,rendered,HEADERLENGTH);
+	if (pageOffset>=0)
+	{
+		ptr+=pageOffset;
+		ptr[0]=hexDigit(mag);
+		ptr[1]=hexDigit(page>>4);
+		ptr[2]=hexDigit(page);
+	}
+} // headerRender
@@ -0,0 +1,69 @@
+/** ***************************************************************************
+ * Description       : VBIT Header template
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+#ifndef _HEADER_H_
+#define _HEADER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet.h"
+#include "tables.h"
+
+/** The header template is the last 32 characters of every header packet.
+ * These codes in the template are filled in on transmission.
+ * Each one is only replaced once, at its first place in the template.
+ * %%#	Magazine and page number
+ * %%a	Day name, Mon
+ * %%b	Month name, Jan
+ * %d	Day of month with leading zero
+ * %e	Day of month with leading space
+ * %m	Month number
+ * %y	Two digit year
+ * %H	Hours
+ * %M	Minutes
+ * %S	Seconds
+ */
+
+// Number of characters in the header template
+#define HEADERLENGTH 32
+
+/** headerCompile - Find where the codes are in a header template
+ * Call when the template is set, before the stream thread starts.
+ * \param template : HEADERLENGTH characters
+ */
+void headerCompile(char *template);
+
+/** headerRender - Fill in the last HEADERLENGTH bytes of a header packet, with parity
+ * The time is only formatted once a second. Each header just copies it
+ * and adds its page number. Only call this from the stream thread.
+ * \param pkt : A header packet
+ * \param mag : Magazine 1..8
+ * \param page : Page number 00..FF
+ */
+void headerRender(char *pkt, uint8_t mag, uint8_t page);
+
+#endif
@@ -1,6 +1,6 @@
 /** ***************************************************************************
  * Description       : VBIT: Magazine page to packet converter.
- * The Pages folder is scanned for pages belonging to a mag.
+ * The Pages folder is scanned once and each page is handed to its mag.
  * This list of pages is used to sequence packets for this mag.
  * There are eight instances of this thread, one per mag.
  *
@@ -47,23 +47,26 @@
 
 // Number of packets in a magazine buffer. 20 is an arbitrary number
 
-#define PACKETCOUNT 20
+#define PACKETCOUNT 32
 
-// MAXCAROUSEL is an arbitrary number, the maximum number of carousels per magazine 
-// 16 is a good value. Should not have too many carousels as it slows the main service.
-// but increase this if you need more.
-#define MAXCAROUSEL 32
+// Number of threads that compile the pages at start up
+#define LOADTHREADS 4
 
 int r1=0;	// Not actually used, just a dummy arg.
 
 // uint8_t thismag;
 
-bufferpacket magBuffer[9];	// One buffer control block for each magazine (plus 1 for out-of-sequence packets like subtitles)
+bufferpacket magBuffer[8];	// One buffer control block for each magazine. Subtitles have their own, in nu4.c
 
 // The actual packet storage
-uint8_t magPacket[9][PACKETCOUNT][PACKETSIZE];	// 9 threads, 20 packets, 45 bytes per packet  
+bufferslot magPacket[8][PACKETCOUNT];	// 8 threads, 32 packets and their descriptors
 
 static pthread_t magThread[8];
+#ifndef WIN32
+static pthread_t watchThread;	// Reloads pages when the pages folder changes
+static int watchFd=-1;	// The watcher's inotify handle. Closed by magStop
+static int reloadPipe[2]={-1,-1};	// magReload writes here to ask the watcher for a full reload
+#endif
 
 static uint8_t magCount=1;	// Ensure that each thread has a different mag number
 
@@ -73,180 +76,149 @@ char pagesPath[MAXPATH]="/home/pi/Pages/"; // location of tti files. Set a defau
 // Carousel stuff
 typedef struct _CAROUSEL_ 
 {
-	PAGE *page;		/// Page meta data 
-	time_t time;	/// System time of the next transmission 
-	uint32_t subcode;	/// Single pages tend to set this 0. Carousels start with 1
+	STOREDPAGE *page;		/// Page meta data and packets
+	uint64_t due;	/// millis() when the next subpage is due
+	unsigned int next;	/// Index of the next subpage to send
 } CAROUSEL;
 
-/** addCarousel
- * Adds a carousel page p to the carousel list c.
- * \param c : A carousel list
- * \param p : A page meta data object
- * \return 0 OK, 1 Fail
+/** The pages of one magazine.
+ * The mag thread sends from these lists while the page watcher updates them,
+ * so everything in here is protected by lock.
  */
-uint8_t addCarousel(CAROUSEL *c,PAGE *p)
+typedef struct _MAGLIST_
 {
-	uint8_t i,found,foundindex;	// found an empty cell
-	found=0;
-	foundindex=0;
-	for (i=0;i<MAXCAROUSEL;i++)
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/// Signalled when a page is added, so that an empty magazine can start at once
+	STOREDPAGE *txList[256];	/// One pointer per page. There are 256 possible pages in a magazine
+	CAROUSEL *carousel;		/// Carousels in a min-heap on due. carousel[0] is the next one due.
+	unsigned int carouselCount;	/// Number of carousels in the heap
+	unsigned int carouselSize;	/// Number of carousels that there is room for
+} MAGLIST;
+
+static MAGLIST magList[8];	// Indexed by mag%8, so magazine 8 is magList[0]
+
+/** carouselUp - Move carousel i towards the top of the heap until it is in order
+ */
+static void carouselUp(CAROUSEL *c, unsigned int i)
+{
+	CAROUSEL t;
+	while (i>0 && c[(i-1)/2].due>c[i].due)
 	{
-		// Not sure why this doesn't work, or if we actually need it
-		if (c[i].page==p)
-		{
-			// printf("[addCarousel]Oh dear, we found a duplicate. Now what? %ul ",(unsigned int)p); // Ignore it and hope it goes away
-			return 1;
-		}
-		if (c[i].page==NULL && !found) // record the first empty slot found
-		{
-			found=1;
-			foundindex=i;
-			// printf("[addCarousel] Found = %d\n",foundindex);
-		}
+		t=c[i];
+		c[i]=c[(i-1)/2];
+		c[(i-1)/2]=t;
+		i=(i-1)/2;
 	}
-	if (!found)	// No available slots left
+}
+
+/** carouselDown - Move carousel i towards the bottom of the heap until it is in order
+ * \param n : Number of carousels in the heap
+ */
+static void carouselDown(CAROUSEL *c, unsigned int n, unsigned int i)
+{
+	CAROUSEL t;
+	unsigned int child;
+	for (child=2*i+1;child<n;child=2*i+1)
 	{
-		// printf("[addCarousel]Can't add carousel. Sorry\n"); // oh no
-		return 1;
+		if (child+1<n && c[child+1].due<c[child].due)
+			child++;	// The earlier of the two children
+		if (c[i].due<=c[child].due)
+			break;
+		t=c[i];
+		c[i]=c[child];
+		c[child]=t;
+		i=child;
 	}
+}
 
-	// We found an empty slot. Lets go fill it
-	// printf("[addCarousel]Carousel \"%s\" (%d%02x), SC=%d in %d\n",p->filename,p->mag,p->page,p->subcode,foundindex);
-	// printf("[addCarousel] p=%u\n",(unsigned int)p);
-	c[foundindex].page=p;
-	c[foundindex].subcode=0;	// Start from a sensible place
-	c[foundindex].time=time(NULL);
+/** addCarousel
+ * Adds a carousel page p to the carousel heap of magazine m.
+ * Call with the magazine lock held.
+ * \param m : A magazine
+ * \param p : A stored page
+ * \param due : millis() when it should go out
+ * \param next : The subpage to start from
+ * \return 0 OK, 1 Fail
+ */
+uint8_t addCarousel(MAGLIST *m, STOREDPAGE *p, uint64_t due, unsigned int next)
+{
+	CAROUSEL *c;
+	if (m->carouselCount>=m->carouselSize)	// Make some more room
+	{
+		c=realloc(m->carousel,(m->carouselSize ? m->carouselSize*2 : 16)*sizeof(CAROUSEL));
+		if (!c)
+			return 1;	// oh no
+		m->carousel=c;
+		m->carouselSize=m->carouselSize ? m->carouselSize*2 : 16;
+	}
+	// printf("[addCarousel]Carousel \"%s\" (%d%02x), SC=%d\n",p->filename,p->page.mag,p->page.page,p->page.subcode);
+	c=&m->carousel[m->carouselCount];
+	c->page=p;
+	c->due=due;
+	c->next=next;
+	carouselUp(m->carousel,m->carouselCount++);
 	return 0;	
 }
 
-/** pageToTransmit - Find the next carousel page update
- * \param c : The carousels array
- * \param fp : A file pointer. If there is a carousel, the file pointer will be set to the required page
- * \param page : The page object for the selected page
- * \return Time when the carousel page changes. Or if 0, there is no page.
+/** removeCarousel - Take carousel i out of the heap and release its page
+ * Call with the magazine lock held.
  */
- time_t pageToTransmit(CAROUSEL *c, FILE** fp, PAGE *page)
+static void removeCarousel(MAGLIST *m, unsigned int i)
 {
-	const uint16_t MAXLINE=200;
-	time_t t;
-	time_t retval=0;
-	uint8_t i;
-	uint8_t timeInterval=0;
-	uint32_t sc;
-	char str[MAXLINE]; // Make this longer than the longest possible description line, because if it is bigger it will mute the page.
-	//printf("K");
-	PAGE p;
-
-	if (!c[0].page) return 0;	// If there are no carousels, exit immediately
-	ClearPage(&p);
-	//sprintf(p.filename,"no filename found on mag %d",mag);
-	// Get the current time
-	t=time(NULL);
-	// Which page is ready to go?
-	for (i=0;i<MAXCAROUSEL;i++)	// Check all the carousels
-	{
-		if ((c[i].page!=NULL) && c[i].time<t)	// Is the page due?
-		{
-			// This is all about finding the next subcode and 
-			// moving the file pointer ready to transmit the next page
-			//printf("Seeking subcode %d \n",c[i].subcode);
-			//printf("Opening %s \n",c[i].page->filename);
-			strcpy(p.filename,c[i].page->filename);
-			*fp=fopen(c[i].page->filename,"r");
-			if (!*fp)
-			{
-				// printf("[pageToTransmit] file open Failed: Placeholder SEVEN str=%s\n",str);
-				*fp=NULL;
-				return 0;
-			}
+	PageStoreRelease(m->carousel[i].page);
+	m->carouselCount--;
+	if (i==m->carouselCount)
+		return;	// It was the last one
+	m->carousel[i]=m->carousel[m->carouselCount];	// Fill the hole with the last one
+	carouselUp(m->carousel,i);
+	carouselDown(m->carousel,m->carouselCount,i);
+}
 
-			// Parse until we find a bigger subpage
-			sc=c[i].subcode;	// The existing subcode
-			while (p.subcode<=sc && !feof(*fp))	// Parse the carousel
-			{
-				fgets(str,MAXLINE,*fp);
-				// printf("[pageToTransmit]Parsing %s",str);	// Note: The line already has \n in it
-				if (ParseLine(&p, str))					// The parse failed
-				{
-					// printf("[pageToTransmit] Parse Failed: Placeholder FOUR str=%s fn=%s\n",str,c[i].page->filename);
-					delay(1000);
-				}
-				// Note: A carousel takes timing from the first CT command only
-				if (p.time && !timeInterval)
-				{
-					timeInterval=p.time;
-					// printf("[pageToTransmit] Mag %d, time interval=%d\n",mag, p.time);
-				}
-			}
-			// timeInterval=p.time;
-			// At this point we either have the next page or we ran off the end
-			// printf("[pageToTransmit] page %d %d Entered with %d, next found %d\n",p.mag,p.page,sc,p.subcode);
-			// If we hit the end of file, we should restart with subcode 1
-	//printf("T\n");
-			if (feof(*fp)) // Ran off the end
-			{
-	//printf("X\n");
-				// Loop back to the start of the carousel
-				// Just reposition the text pointer to the start
-				if (fseek(*fp,0,0))
-				{
-					// printf("[pageToTransmit] Seek failed: Placeholder FIVE str=%s\n",str);
-				}
-				// And set the subcode to 1 (first page of a carousel) 
-				c[i].subcode=0; // The next subcode to expect would be 1, but 0 should work too.
-				// printf("[pageToTransmit] Out of data. Placeholder ONE\n");
-			}
-			else
-			{
-					//printf("Y\n");
-// TODO: This works if SC follows CT otherwise we will have to do a bit more parsing
-				c[i].subcode=p.subcode;
-				if (p.time>0)
-					timeInterval=p.time;	// Good
-				else
-				{
-					timeInterval=15;		// Error, set sensible default
-					//printf("[pageToTransmit] Missing time interval. Placeholder SIX\n");
-				}
-					//printf("Z\n");
+/** pageToTransmit - Find the next carousel page update
+ * Only the top of the heap needs to be looked at.
+ * Call with the magazine lock held.
+ * \param m : The magazine
+ * \param page : Set to the carousel that is due, or NULL if none is due
+ * \param subpage : Set to the index of the subpage to transmit
+ * \return millis() when the next carousel page changes. Or if 0, there are no carousels.
+ */
+uint64_t pageToTransmit(MAGLIST *m, STOREDPAGE **page, unsigned int *subpage)
+{
+	uint64_t t;
+	unsigned int ix;
+	unsigned int timeInterval;
+	CAROUSEL *c=m->carousel;
 
-			}
-			// Reschedule this carousel
-			c[i].time=time(NULL)+timeInterval; 
-			break;
-		} // page is due
-	} // for
-	// Now work out when the next carousel page changes.
-	retval=0;
-	for (i=0;i<MAXCAROUSEL;i++)
+	*page=NULL;
+	if (!m->carouselCount) return 0;	// If there are no carousels, exit immediately
+	// Get the current time
+	t=millis();
+	if (c->due<=t)	// Is the page due?
 	{
-		if (c[i].page) // if the page exists
+		#ifdef WIN32
+		if (PageStoreRefresh(c->page))	// No page watcher, so check the file. Gone or broken? Try again later
 		{
-			if (c[i].time>0)	// a valid time 
-			{
-				// Save the time if we don't have one or it is less than what we have
-				if (c[i].time<retval || retval==0)
-				{
-					retval=c[i].time;
-				}
-			}
-			else
-			{
-				// printf("[pageToTransmit] Mag %d, carousel %d, Time is 0. This is bad\n",mag,i);
-			}
+			c->due=t+15000;
+			carouselDown(m->carousel,m->carouselCount,0);
+			return m->carousel[0].due;
 		}
-	}
-	// printf("Mag %d, Next retval=%d\n",mag,(int)retval);
-	if (!p.filename[0])	// For some reason got here without a page? (If ClearPage sets a null string)
-	{
-		// printf("[pageToTransmit] filename bug that needs fixing\n");
-		retval=0;	// Really need to investigate how this fails. It should never happen.
-	}
-	
-	*page=p;
-	// printf("[PageToTransmit] L filename=%s mag=%d page=%02x, subcode=%d\n",p.filename,p.mag,p.page,p.subcode);
-	// printf("M retval=%d\n",(int)retval);
-	return retval;	
+		#endif
+		// The subpage index takes us straight to the next subpage
+		ix=c->next;
+		if (ix>=c->page->subpageCount) // Ran off the end
+			ix=0;	// Loop back to the start of the carousel
+		c->next=ix+1;
+		timeInterval=c->page->subpage[ix].time;	// Each subpage has its own CT
+		if (!timeInterval)
+			timeInterval=15000;		// Missing CT, set sensible default
+		*page=c->page;
+		*subpage=ix;
+		// Reschedule this carousel
+		c->due=t+timeInterval; 
+		carouselDown(m->carousel,m->carouselCount,0);
+	} // page is due
+	// Now the next carousel page change is on the top of the heap
+	return m->carousel[0].due;	
 } // pageToTransmit
 
 /** getMag - Allocate a magazine to a thread.
@@ -261,152 +233,446 @@ uint8_t getMag(void)
 	return num;
 }
 
-/** getList - Populate a magazine list
- * Declare the list in domag so we use auto variables. So each thread gets its own environment.
+/** findCarousel - Find the carousel that was loaded from filename
+ * Call with the magazine lock held.
+ * \return The carousel or NULL if there isn't one
  */
-uint8_t getList(PAGE **txList,uint8_t mag, CAROUSEL *carousel)
+static CAROUSEL *findCarousel(MAGLIST *m, char *filename)
+{
+	unsigned int i;
+	for (i=0;i<m->carouselCount;i++)
+		if (!strcmp(m->carousel[i].page->filename,filename))
+			return &m->carousel[i];
+	return NULL;
+}
+
+/** dropPage - Take a page file out of a magazine
+ * Call with the magazine lock held.
+ * \param m : The magazine
+ * \param filename : The page file
+ */
+static void dropPage(MAGLIST *m, char *filename)
+{
+	unsigned int i;
+	for (i=0;i<256;i++)
+	{
+		if (m->txList[i] && !strcmp(m->txList[i]->filename,filename))
+		{
+			PageStoreRelease(m->txList[i]);
+			m->txList[i]=NULL;
+		}
+	}
+	for (i=m->carouselCount;i>0;i--)	// Backwards, as removing one moves the last one into its place
+	{
+		if (!strcmp(m->carousel[i-1].page->filename,filename))
+			removeCarousel(m,i-1);
+	}
+}
+
+void magAddPage(STOREDPAGE *sp)
+{
+	uint8_t i;
+	MAGLIST *m=&magList[sp->page.mag % 8];
+	CAROUSEL *c;
+	CAROUSEL old;	// Where an earlier version of this carousel had got to
+	// The file might have moved to another magazine
+	for (i=0;i<8;i++)
+	{
+		if (&magList[i]==m) continue;
+		pthread_mutex_lock(&magList[i].lock);
+		dropPage(&magList[i],sp->filename);
+		pthread_mutex_unlock(&magList[i].lock);
+	}
+	pthread_mutex_lock(&m->lock);
+	c=findCarousel(m,sp->filename);
+	if (c)
+		old=*c;
+	else
+	{
+		old.page=NULL;	// A new carousel starts now from the first subpage
+		old.due=millis();
+		old.next=0;
+	}
+	// Replace any earlier version of this file
+	dropPage(m,sp->filename);
+	// If subcode is greater than 1 we want to save that page as a carousel
+	if (sp->page.subcode>1)
+	{
+		// An edited carousel carries on where it was rather than starting again
+		if (addCarousel(m,sp,old.due,old.next<sp->subpageCount ? old.next : 0))
+		{
+			fprintf(stderr,"[magAddPage] Out of memory on mag %d. Dropped %s\n",sp->page.mag,sp->filename);
+			PageStoreRelease(sp);	// No room for it
+		}
+	}
+	else
+	{
+		// Check that we don't have a duplicate!!!
+		if (m->txList[sp->page.page])
+		{
+			//printf("[mag:magAddPage] Page already exists. old=%s, new=%s\n",m->txList[sp->page.page]->filename,sp->filename);
+			PageStoreRelease(m->txList[sp->page.page]);
+		}
+		m->txList[sp->page.page]=sp;	// Store as a normal non carouselling page
+	}
+	pthread_cond_signal(&m->wake);	// In case the mag thread is idle
+	pthread_mutex_unlock(&m->lock);
+	//printf("[magAddPage]Saved page %s mpp=%01d%02x\n",sp->filename,sp->page.mag,sp->page.page);
+} // magAddPage
+
+void magRemovePage(char *filename)
+{
+	uint8_t i;
+	for (i=0;i<8;i++)
+	{
+		pthread_mutex_lock(&magList[i].lock);
+		dropPage(&magList[i],filename);
+		pthread_mutex_unlock(&magList[i].lock);
+	}
+} // magRemovePage
+
+/** isPageFile - Is this the name of a tti page?
+ */
+static uint8_t isPageFile(const char *name)
+{
+	return strcasestr(name,".tti") || strcasestr(name,".ttix");
+}
+
+/** pageFilename - Assemble the full name of a file in the pages folder
+ * \param filename : Result. MAXPATH characters.
+ * \param name : Name of the file in pagesPath
+ */
+static void pageFilename(char *filename, const char *name)
+{
+	int i;
+	/* hopefully assemble a filename without a buffer overflow */
+	strncpy(filename,pagesPath,MAXPATH-1);
+	filename[MAXPATH-1]=0;
+	i = filename[(strlen(filename)-1)];
+	if (i != '/' && i != '\\' && strlen(filename) + 1 < MAXPATH)
+		strcat(filename, "/"); // append missing trailing slash
+	i = strlen(filename) + strlen(name);
+	if (i < MAXPATH){
+		strcat(filename,name);
+	}
+}
+
+/** The page files found by loadPages, shared out between the loader threads
+ */
+typedef struct _LOADLIST_
+{
+	pthread_mutex_t lock;
+	char **filename;	/// Full names of the page files
+	int count;			/// Number of entries in filename
+	int next;			/// The next file that a loader should take
+} LOADLIST;
+
+/** loadWorker - Loader thread. Compiles files from the list until there are none left
+ * \param arg : The LOADLIST
+ */
+static void *loadWorker(void *arg)
+{
+	LOADLIST *list=arg;
+	STOREDPAGE *sp;
+	int i;
+	while (1)
+	{
+		pthread_mutex_lock(&list->lock);
+		i=list->next++;
+		pthread_mutex_unlock(&list->lock);
+		if (i>=list->count)
+			break;
+		sp=PageStoreLoad(list->filename[i]);
+		if (sp)
+			magAddPage(sp);	// Each page goes straight to its own magazine
+		//else printf("Not a valid page %s\n",list->filename[i]);
+	}
+	return NULL;
+} // loadWorker
+
+/** loadPages - Populate all the magazine lists
+ * The pages folder is scanned once and each file is compiled once,
+ * with the work spread over LOADTHREADS threads.
+ * \return 0 OK, 1 Could not read the pages folder
+ */
+static uint8_t loadPages(void)
 {
 	DIR *d;		// Directory handle
-	PAGE page;
-	PAGE *p;		// Page that we are going to parse
-	PAGE *newpage;
-	char filename[MAXPATH];
 	struct dirent *dir;
-	uint8_t i;
-	// Make sure all the carousel entries are NULL
-	for (i=0;i<MAXCAROUSEL;i++)
+	char filename[MAXPATH];
+	char **names;
+	int capacity=0;
+	LOADLIST list;
+	pthread_t loader[LOADTHREADS];
+	int threads;
+	int i;
+
+	d = opendir(pagesPath);
+	if (!d)
+		return 1;
+	memset(&list,0,sizeof(list));
+	while ((dir = readdir(d)) != NULL)
 	{
-		carousel[i].page=NULL;
-		carousel[i].time=0;
-		carousel[i].subcode=0;
+		// TODO: Is it a directory?
+		// Is it a tti page
+		if (!isPageFile(dir->d_name))
+			continue;
+		if (list.count>=capacity)
+		{
+			capacity=capacity ? capacity*2 : 256;
+			names=realloc(list.filename,capacity*sizeof(char*));
+			if (!names) break;
+			list.filename=names;
+		}
+		pageFilename(filename,dir->d_name);
+		list.filename[list.count]=strdup(filename);
+		if (list.filename[list.count])
+			list.count++;
 	}
-	
-  d = opendir(pagesPath);
-  p=&page;
-  if (d)
-  {
-    while ((dir = readdir(d)) != NULL)
-    {
-	  // TODO: Is it a directory?
-	  // Is it a tti page
-	  if (strcasestr(dir->d_name,".tti") || strcasestr(dir->d_name,".ttix"))
-	  {
-		  /* hopefully assemble a filename without a buffer overflow */
-		  strncpy(filename,pagesPath,MAXPATH-1);
-		  i = filename[(strlen(filename)-1)];
-		  if (i != '/' && i != '\\' && strlen(filename) + 1 < MAXPATH)
-			  strcat(filename, "/"); // append missing trailing slash
-		  i = strlen(filename) + strlen(dir->d_name);
-		  if (i < MAXPATH){
-			strncat(filename,dir->d_name, i);
-		  }
-		  
-		  //printf("stream %d, %s\n", mag, filename);
-		  if (ParsePage(p, filename))
-		  {
-				//printf("Not a valid page %s\n",filename);
-		  }
-		  //printf("Comparing p->mag %d, p->page %d, mag %d\n",p->mag % 8, p->page, mag);
-		  if ((p->mag % 8)==mag)
-		  {
-			strcpy(p->filename,filename);
-			//printf("Accepted mag %d page %s\n",mag, p->filename);
-			// Create a new page object
-			newpage=calloc(1,sizeof(PAGE));
-			// Copy the data
-			*newpage=*p;
-			// And drop the pointer into the transmission list
-			// Check that we don't have a duplicate!!!
-			if (txList[p->page])
+	closedir(d);
+
+	pthread_mutex_init(&list.lock,NULL);
+	for (threads=0;threads<LOADTHREADS && threads<list.count;threads++)
+	{
+		if (pthread_create(&loader[threads],NULL,loadWorker,&list))
+			break;
+	}
+	if (!threads)
+		loadWorker(&list);	// Couldn't start any threads? Do it ourselves.
+	for (i=0;i<threads;i++)
+		pthread_join(loader[i],NULL);
+	pthread_mutex_destroy(&list.lock);
+
+	for (i=0;i<list.count;i++)
+		free(list.filename[i]);
+	free(list.filename);
+	return 0;
+} // loadPages
+
+/** pruneMissing - Take pages whose file has gone off the air
+ * Call with the magazine lock held.
+ */
+static void pruneMissing(MAGLIST *m)
+{
+	struct stat st;
+	unsigned int i;
+	for (i=0;i<256;i++)
+	{
+		if (m->txList[i] && stat(m->txList[i]->filename,&st))
+		{
+			PageStoreRelease(m->txList[i]);
+			m->txList[i]=NULL;
+		}
+	}
+	for (i=m->carouselCount;i>0;i--)
+		if (stat(m->carousel[i-1].page->filename,&st))
+			removeCarousel(m,i-1);
+}
+
+/** reloadPages - Compile every page again and drop the pages whose file has gone
+ * Only the page watcher calls this while it is running, so the reloads and the
+ * single page changes happen one after the other in the order they were asked for.
+ */
+static void reloadPages(void)
+{
+	int i;
+	if (loadPages())
+		fprintf(stderr,"Could not find pages in %s\n",pagesPath);
+	for (i=0;i<8;i++)
+	{
+		pthread_mutex_lock(&magList[i].lock);
+		pruneMissing(&magList[i]);
+		pthread_mutex_unlock(&magList[i].lock);
+	}
+} // reloadPages
+
+#ifndef WIN32
+/** pageWatch - Thread that keeps the magazines in step with the pages folder
+ * inotify tells us which file changed, so only that file is compiled again
+ * and the rest of the service carries on undisturbed.
+ */
+static void *pageWatch(void *dummy)
+{
+	int fd;
+	ssize_t len;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char *ptr;
+	const struct inotify_event *event;
+	char filename[MAXPATH];
+	STOREDPAGE *sp;
+	struct pollfd fds[2];
+	(void)dummy;
+
+	// magStop cancels us while we wait for a change, but never while a page is half loaded
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL);
+	fd=watchFd;
+	fds[0].fd=fd;
+	fds[0].events=POLLIN;
+	fds[1].fd=reloadPipe[0];
+	fds[1].events=POLLIN;
+	while (1)
+	{
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,NULL);
+		len=poll(fds,2,-1);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL);
+		if (len<0)
+		{
+			if (errno==EINTR) continue;
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			// Any number of requests are answered by one reload
+			while (read(reloadPipe[0],buf,sizeof(buf))>0);
+			reloadPages();
+		}
+		if (!(fds[0].revents & POLLIN))
+			continue;
+		len=read(fd,buf,sizeof(buf));
+		if (len<=0)
+		{
+			if (len<0 && (errno==EINTR || errno==EAGAIN)) continue;
+			break;
+		}
+		for (ptr=buf;ptr<buf+len;ptr+=sizeof(struct inotify_event)+event->len)
+		{
+			event=(const struct inotify_event *)ptr;
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				// Too many changes at once and some were lost. Don't know which, so look at them all.
+				fprintf(stderr,"[pageWatch] Missed some page changes. Reloading all the pages\n");
+				reloadPages();
+				continue;
+			}
+			if (!event->len || !isPageFile(event->name))
+				continue;
+			pageFilename(filename,event->name);
+			if (event->mask & (IN_DELETE | IN_MOVED_FROM))
 			{
-				//printf("[mag:getList] Page already exists. old=%s, new=%s\n",txList[p->page]->filename,p->filename);
+				#ifdef _DEBUG_
+				fprintf(stderr,"[pageWatch] Removed %s\n",filename);
+				#endif
+				magRemovePage(filename);
 			}
-			// If subcode is greater than 1 we want to save that page as a carousel
-			if (p->subcode>1)
+			else
 			{
-				// printf("subcode=%d ",p->subcode);
-				addCarousel(carousel,newpage);
+				#ifdef _DEBUG_
+				fprintf(stderr,"[pageWatch] Reloading %s\n",filename);
+				#endif
+				sp=PageStoreLoad(filename);
+				if (sp)
+					magAddPage(sp);
+				else
+					magRemovePage(filename);	// No longer a valid page
 			}
-			 else {
-				txList[p->page]=newpage;	// Store as a normal non carouselling page
-			 }
-			//printf("[getList]Saved page %s mpp=%01d%02d\n",txList[p->page]->filename,txList[p->page]->mag,txList[p->page]->subpage);
-		  }
-	  }
-	  // TODO: Something wonderful with the PAGE object
-    }
-    closedir(d);
-  }
-  else
-	return 1;
-  return 0;	
-} // getList
+		}
+	}
+	return NULL;
+} // pageWatch
+#endif
+
+/** dynamicRow - Fill in the system tokens on a row packet
+ * Temperature: %%%T : 58.4
+ * Time and date: %%%%%%%%%%%%timedate
+ * World time: %t+hh or %t-hh
+ * Network address: %%%%%%%%%%%%%%n
+ * Version: %%%V
+ * The page store has already found the tokens, so only their bytes are written
+ * and given parity. The rest of the row is sent as it was compiled.
+ * \param packet : A copy of the row packet
+ * \param page : The page that the row belongs to
+ * \param pkt : The stored row
+ */
+static void dynamicRow(char *packet, STOREDPAGE *page, STOREDPACKET *pkt)
+{
+	char value[21];
+	SAMPLE sample;	// System status from the sampler thread
+	ROWTOKEN *t=&page->token[pkt->token];
+	uint8_t i;
+	for (i=0;i<pkt->dynamic;i++,t++)
+	{
+		switch (t->type)
+		{
+		case TOKEN_TEMP:
+			samplerGet(&sample);
+			memcpy(value,sample.temp,4);
+			break;
+		case TOKEN_TIMEDATE:
+			get_time(value);
+			break;
+		case TOKEN_OFFSETTIME:
+			format_offset_time(value,t->arg);
+			break;
+		case TOKEN_NET:
+			samplerGet(&sample);
+			memcpy(value,sample.net,15);
+			break;
+		case TOKEN_VERSION:
+			memcpy(value,"1.00",4); // @todo: Move this value to somewhere more obvious
+			break;
+		}
+		memcpy(packet+t->offset,value,t->length);
+		ParityEncode((uint8_t*)packet+t->offset,t->length);
+	}
+}
+
+/** magPut - Put a packet on a magazine buffer, waiting for room if it is full
+ * \param mag : The magazine thread
+ * \param packet : The packet to send
+ * \param page : The page that the packet comes from
+ * \param row : The row number of the packet
+ */
+static void magPut(uint8_t mag, char *packet, STOREDPAGE *page, uint8_t row)
+{
+	packetmeta meta;
+	meta.created=micros();
+	meta.moved=0;
+	meta.mag=page->page.mag;
+	meta.row=row;
+	meta.page=page->page.page;
+	meta.flags=row ? 0 : PACKETMETA_HEADER;
+	while (bufferPutMeta(&magBuffer[mag],packet,&meta)==BUFFER_FULL && piRunning())
+		bufferWaitSpace(&magBuffer[mag],1000);
+}
 
 /** domag is the thread that manages a single magazine
- * Finds and sorts all the pages for a particular magazine.
- * Manages adding and removing pages.
- * Maintains a state machine: IDLE, HEADER, ROW
+ * Sends the pages that magInit found for this magazine.
+ * The page watcher adds and removes pages while we run.
+ * Maintains a state machine: IDLE, SENDING
+ * The packets come ready made from the page store.
  */
 void domag(void)
 {
-	const uint16_t MAXLINE=200;
-	uint16_t i;
 	uint8_t txListIndex;	// The current page
 	uint8_t txListStart;	// Help prevent an endless loop
-	PAGE* txList[256];	// One pointer per page. There are 256 possible pages in a magazine
+	MAGLIST *m;
 	uint8_t mag;
-	uint8_t row;
 	uint8_t state;
-	uint8_t packet[PACKETSIZE];
-	PAGE* page=NULL;
-	FILE* fil=NULL;
-	time_t txwait=0;
-	uint8_t isCarousel;
-	PAGE carPage;
-	int triplet;
-	// Some working space for manipulating strings
-	char strtemp[100];
-	char *tmpptr;
+	char packet[PACKETSIZE];
+	STOREDPAGE* page=NULL;	// The page being sent. We hold a reference on it.
+	STOREDPACKET* pkt;
+	SUBPAGE* sub;
+	unsigned int subpage=0;
+	unsigned int packetIndex=0;	// The next packet of the page to send
+	unsigned int packetEnd=0;	// One past the last packet of the page
+	uint64_t due;	// When the next carousel subpage is due
+	uint64_t now;
+	uint64_t cycleStart=millis();	// When the main sequence last started again from the top
+	struct timespec when;
 	
-	CAROUSEL carousel[MAXCAROUSEL];		// Is 16 enough carousels? If not then change this yourself.
-	char str[MAXLINE];
-	// Init the transmission list for this magaine
-	for (i=0;i<256;i++)
-		txList[i]=NULL;
-	// Work out which magazine we are
+	// Work out which magazine we are. magInit has already loaded our pages.
 	mag=getMag();
-	// Find the pages for this mag and put them into the transmission list.
-	piLock(1);
-	if (getList(txList,mag,carousel))
-	{
-#ifdef _DEBUG_
-		fprintf(stderr,"Could not find pages on stream %1d       \n",mag);
-#endif		
-		piUnlock(1);
-		return;
-	}
-#ifdef _DEBUG_
-	
-	for (i=0;i<MAXCAROUSEL;i++)
-	{
-		if (carousel[i].page)
-		{
-			fprintf(stderr,"[domag] Carousels found on mag %d\n",mag);
-		}
-	}
-#endif
-	delay(400); // EVIL HACK masking a race condition, root cause unknown...
-	piUnlock(1);
+	m=&magList[mag];
 	// printf("Mag thread is initialised: mag=%d\n",mag);
 	// Initialise the magazine state
 	state=STATE_BEGIN;
 	// Start at page 0
 	txListIndex=0;
 	// The mag loop has a page counter that steps through all the pages
-	// There is a state variable which helps step through the file.
-	while(1)
+	// There is a state variable which helps step through the page packets.
+	while (piRunning())
 	{	
-		while (bufferIsFull(&magBuffer[mag])) delay(20); // ms
+		bufferWaitSpace(&magBuffer[mag],1000);	// Sleep until stream.c takes a packet
 		switch (state)
 		{
 		case STATE_BEGIN:	// First time only
@@ -415,244 +681,140 @@ void domag(void)
 			break;
 		case STATE_IDLE:	// Ready to start a new page
 			// Find the next page to transmit
-			isCarousel=0;
+			pthread_mutex_lock(&m->lock);
+			PageStoreRelease(page);	// Finished with the last one
+			page=NULL;
 			// Timed carousel pages have priority	
-			if (txwait<time(NULL))	// If we are due to transmit a carousel
-			{
-				txwait=pageToTransmit(carousel,&fil,&carPage);
-				if (txwait==0)
-				{
-					
-					// If we are expecting a carousel but only this happens, then PageToTransmit is broken
-					txwait=time(NULL)+10;					
-				}
-				else
-				{
-					// If we get here then fp has a valid carousel file
-					isCarousel=1;
-				}
-			}
-			// If we didn't get a page object from pageToTransmit, we get it from the main list
-			if (!isCarousel) 
+			due=pageToTransmit(m,&page,&subpage);
+			// If we didn't get a page from pageToTransmit, we get it from the main list
+			if (!page) 
 			{
 				// Find the next page in the main sequence
-				txListStart=txListIndex;	// Avoid infinite loop if we have no pages in mag, (should go to another idle state if this happens)
-				txListIndex++;
-				while(!txList[txListIndex] )
+				txListStart=txListIndex;	// Avoid infinite loop if we have no pages in mag
+				do
 				{
 					txListIndex++;	// This will automatically wrap, hence no range checking.
-					if (txListStart==txListIndex)	// oops. This magazine has nothing to show
-					{
-						state=STATE_BEGIN;	
-						#ifdef _DEBUG_
-						fprintf(stderr,"[domag] Magazine %d contains no pages\n",mag);
-						#endif
-						delay(1000);	// Might as well do nothing most of the time
-						#ifdef _DEBUG_
-						fprintf(stderr,"[domag] Delay with no pages. mag=%d\n",mag);
-						#endif
-						break;
-					}				
+				} while (!m->txList[txListIndex] && txListIndex!=txListStart);
+				if (txListIndex<=txListStart && m->txList[txListIndex])	// Wrapped round. That's one cycle.
+				{
+					now=millis();
+					metricsSet(metrics.magCycle[mag],now-cycleStart);
+					cycleStart=now;
 				}
-				
 				// Now we have the found the next page we get ready to transmit it.
-				page=txList[txListIndex];		// Get the page object
+				page=m->txList[txListIndex];		// Get the page object
+				subpage=0;
+				#ifdef WIN32
+				if (page && PageStoreRefresh(page))	// No page watcher, so rebuild it if the file changed
+					page=NULL;	// don't try to send a page whose file got deleted etc.
+				#endif
 			}
-			else
+			if (page)
+				PageStoreHold(page);	// Keep it while we send it, even if the watcher replaces it
+			else	// oops. This magazine has nothing to show
 			{
-				page=&carPage;	// The page is a carousel page
-			
-			}
-			
-			if (page)	// If we found a page to transmit
-			{
-				str[0]=0;
-				if (!fil)	// Carousel will already be scanned down to the page that we want
+				state=STATE_BEGIN;	
+				#ifdef _DEBUG_
+				fprintf(stderr,"[domag] Magazine %d contains no pages\n",mag);
+				#endif
+				// Sleep until the next carousel is due or the page watcher adds a page
+				now=millis();
+				if (!piRunning())
+					;	// magStop has already woken us. Don't wait for another
+				else if (!due)
+					pthread_cond_wait(&m->wake,&m->lock);
+				else if (due>now)
 				{
-					fil=fopen(page->filename,"r");	// Open the Page file if it is not a carousel
-					while (fil && !feof(fil)){ // re-parse the page file to update header
-						fgets(str,MAXLINE,fil);
-						ParseLine(page, str); // TODO: there should probably be some error checking here!
-						if (str[0]=='S' && str[1]=='C') // reached the subcode line
-							break;
-					}
-				}
-				
-				if (!fil){ 
-					// don't try to access a null file pointer (if file got deleted etc.)
-					state=STATE_IDLE;
-					break;
-				}
-					
-				//	printf("[mag]Carousel filename=%s\n",page->filename);
-				while (strncmp(str,"OL,",3) && !feof(fil))				// scan down to the rows
-					fgets(str,MAXLINE,fil);
-
-				if (feof(fil))	// Not found any lines
-				{
-					fclose(fil);
-					fil=NULL;
-					state=STATE_IDLE;
-				}
-				else	// This is the first output line. Parse it and process it.
-				{					
-					// TX the header
-					//sprintf(header,"P%01d%02x %s",page->mag,page->page,page->filename);
-					// Create the header. Note that we force parallel transmission by ensuring that C11 is clear
-					PacketHeader((char*)packet,page->mag,page->page,page->subcode,page->control & ~0x0040);
-					// The header packet isn't quite finished. stream.c intercepts headers and adds dynamic elements, page, date, network ID etc.
-					
-					while (bufferPut(&magBuffer[mag],(char*)packet)==BUFFER_FULL) delay(20); 
-						state=STATE_HEADER;
+					condTimeout(&when,due-now);
+					pthread_cond_timedwait(&m->wake,&m->lock,&when);
 				}
 			}
-			else
-				state=STATE_IDLE;	// We found nothing to send
-			// Change to sending.
+			pthread_mutex_unlock(&m->lock);
+			if (!page)
+				break;
+
+			// TX the header. stream.c intercepts headers and adds dynamic elements, page, date, network ID etc.
+			sub=&page->subpage[subpage];
+			packetIndex=sub->first;
+			packetEnd=sub->first+sub->count;
+			magPut(mag,page->packet[packetIndex].packet,page,0);
+			packetIndex++;
+			state=STATE_SENDING;
 			break;
-		case STATE_HEADER:	// If regional options are set, send the enhancement packet
-/** @todo I suspect that the page enhancements are reversed or something.
- *  Also the RE command appears to be in hex which probably isn't what we want.
- */
-			if (page->region>0 && page->region<=0x0f) // Only send this packet if the page asks for it with a non zero RE command
-			{	
-				// printf("Sending page region=%d\n",page->region);
-				// We need to send the X/28 packet first (maybe???) so here would be a good place to do it.
-				PageEnhancementDataPacket((char*) packet, page->mag, 28,0);
-				triplet=0;
-
-				// Lets assemble triple 1 ETSI 300706 page 30. Also see section 9.4.2.1
-				// 1..4 Page function. We set this to 0 as a standard teletext page. 
-				// 5..7 Page coding. Set this to zero for 7 bit coding.
-				// 8..14 G0/G2/Nat opt.  10,9,8 should be set to C12, C13,C14 TODO. Bits are in 14..11
-				triplet+=page->region<<10; // Not reversed
-				//if (page->region & 0x01) triplet|=0x40; // Reverse the bit order and shift up 7
-				//if (page->region & 0x02) triplet|=0x20;
-				//if (page->region & 0x04) triplet|=0x10;
-				//if (page->region & 0x08) triplet|=0x08;
-				// 15..18 Second G0
-
-				SetTriplet((char*) packet, 1, triplet);
-				// Should we also set triplets 1 to 13?
-				for (i=2;i<=13;i++)
-					SetTriplet((char*) packet, i, 0);
-				Parity((char*)packet,50);	// 50 ensures that we only reverse bytes. Parity would mess up Ham24/8
-				while(bufferPut(&magBuffer[mag],(char*)packet)==BUFFER_FULL) delay(20);
-				// dumpPacket(packet);
-			}
-			// Now we can process the initial row of the page
-			row=copyOL((char*)packet,str);
-			if (row) // If this happens to be OL,0 then don't process packet
-			{
-				PacketPrefix((uint8_t*)packet, page->mag, row);
-				if (row < 26){ // don't mess with parity for packets that would be hammed
-					Parity((char*)packet,5);
-				}
-				//dumpPacket(packet);
-				while (bufferPut(&magBuffer[mag],(char*)packet)==BUFFER_FULL) delay(20);
-			}		
-			state=STATE_SENDING;	// Intentional fall through
-		case STATE_SENDING:	// Transmitting rows
-			fgets(str,MAXLINE,fil);
-			if (str[0]=='O' && str[1]=='L')	// Double check it is OL. It could be FL.
+		case STATE_SENDING:	// Transmitting X/28, rows and fastext
+			if (packetIndex>=packetEnd)	// When we run out of rows to send
 			{
-				row=copyOL((char*)packet,str);
-				if (row)	// Only insert a valid row
-				{
-					if (row < 26){ // don't do anything to packets > 25
-						// Temperature: %%%T : 58.4
-						// Day of week: %%a : Sat
-						// Day of month: 
-						// 
-
-						// Special case for system temperature. Put %%%T to get temperature in form tt.t
-						#ifndef WIN32
-						tmpptr=strstr((char*)packet,"%%%T");
-						if (tmpptr) {
-							get_temp(strtemp);
-							strncpy(tmpptr,strtemp,4);
-						}
-						#endif
-						// Special case for system time. Put %%%%%%%%%%%%timedate to get time and date
-						tmpptr=strstr((char*) packet,"%%%%%%%%%%%%timedate");
-						if (tmpptr) {
-							get_time(strtemp);
-							strncpy(tmpptr,strtemp,20);
-						}
-						// Special case for world time. Put %t<+|-><hh> to get local time HH:MM offset by +/- half hours
-						for (;;)
-						{
-							tmpptr=strstr((char*) packet,"%t+");
-							if (!tmpptr) {
-								tmpptr=strstr((char*) packet,"%t-");
-							}
-							if (tmpptr) {
-								get_offset_time(tmpptr);
-							}
-							else
-								break;
-						}
-						#ifndef WIN32
-						// Special case for network address. Put %%%%%%%%%%%%%%n to get network address in form xxx.yyy.zzz.aaa with trailing spaces (15 characters total)
-						tmpptr=strstr((char*)packet,"%%%%%%%%%%%%%%n");
-						if (tmpptr) {
-							// strncpy(tmpptr,"not yet working",15);
-							get_net(strtemp);
-							strncpy(tmpptr,strtemp,15);
-						}
-						#endif
-						// ======= VERSION ========
-						// %%%V version number eg. 1.00
-						tmpptr=strstr((char*) packet,"%%%V");
-						if (tmpptr) {
-							strncpy(tmpptr,"1.00",4); // @todo: Move this value to somewhere more obvious
-						}	
-						// Finally fix up the parity
-						Parity((char*)packet,5);
-					}
-					PacketPrefix(packet,page->mag,row);
-					while (bufferPut(&magBuffer[mag],(char*)packet)==BUFFER_FULL) delay(20);
-				}
+				state=STATE_IDLE;
+				break;
 			}
-			if (str[0]=='F' && str[1]=='L')	// Fastext links?
+			pkt=&page->packet[packetIndex++];
+			if (pkt->dynamic)
 			{
-				copyFL((char*)packet,str,page->mag);
-				PacketPrefix(packet,page->mag,27); // X/27/0					
-				Parity((char*)packet,5);
-				while (bufferPut(&magBuffer[mag],(char*)packet)==BUFFER_FULL) delay(20);
-			}
-			// When we run out of rows to send
-			if (fil)
-			{
-				if (feof(fil) || (str[0]=='S' && str[1]=='C'))
-				{
-					state=STATE_IDLE;
-					fclose(fil);	// TODO: Don't try to close already closed!
-					fil=NULL;
-				}
-				break;			
+				memcpy(packet,pkt->packet,PACKETSIZE);
+				dynamicRow(packet,page,pkt);
+				magPut(mag,packet,page,pkt->row);
 			}
+			else
+				magPut(mag,pkt->packet,page,pkt->row);
+			break;
 		} // state switch
-		delay(1);	// Just something to break up the sequence
-		// TODO: We should really intercept a shutdown and release all the memory
 	} // while
+	pthread_mutex_lock(&m->lock);
+	PageStoreRelease(page);
+	pthread_mutex_unlock(&m->lock);
 } // domag
 
 
 /** MagInit creates eight domag threads
- * It also sets up the buffers that each thread will use to forward packets.
+ * It also sets up the buffers that each thread will use to forward packets,
+ * loads all the pages and starts the page watcher.
  */
 void magInit(void)
 {
 	int i;
 	const int maxThreads=8; 	// should be 8
 	magCount=1;
-	for (i=0;i<9;i++) // One extra buffer for Newfor
+	for (i=0;i<8;i++)
 	{
 		// Set up the buffers, one per thread
-		bufferInit(&magBuffer[i],(char*)&magPacket[i],PACKETCOUNT);
+		bufferInit(&magBuffer[i],magPacket[i],PACKETCOUNT);
 		// now got to add the packet data itself
 	}
+	for (i=0;i<8;i++)
+	{
+		memset(&magList[i],0,sizeof(MAGLIST));
+		pthread_mutex_init(&magList[i].lock,NULL);
+		condInit(&magList[i].wake);
+	}
+	#ifndef WIN32
+	// Start watching before the pages are read so that no change is missed.
+	// The changes queue up until the watcher starts, once the pages are all loaded.
+	// Otherwise a loader could replace the watcher's newer copy of a page with an older one.
+	watchFd=inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watchFd>=0 && (inotify_add_watch(watchFd,pagesPath,IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)<0 ||
+		pipe2(reloadPipe,O_NONBLOCK | O_CLOEXEC)))
+	{
+		close(watchFd);
+		watchFd=-1;
+	}
+	#endif
+	// Find all the pages and put them into the transmission lists.
+	if (loadPages())
+		fprintf(stderr,"Could not find pages in %s\n",pagesPath);
+	#ifndef WIN32
+	if (watchFd<0 || pthread_create(&watchThread,NULL,pageWatch,NULL))
+	{
+		fprintf(stderr,"[magInit] Can't watch %s. Page changes will need a restart\n",pagesPath);
+		if (watchFd>=0)
+		{
+			close(watchFd);
+			close(reloadPipe[0]);
+			close(reloadPipe[1]);
+			reloadPipe[0]=reloadPipe[1]=-1;
+		}
+		watchFd=-1;
+	}
+	#endif
 	for (i=0;i<maxThreads;i++) {
 		magThread[(i+1)%maxThreads]=0;
 		pthread_create(&magThread[(i+1)%maxThreads],NULL,(void*)domag,(void*)&r1); 	// r1 is just a dummy arg.
@@ -660,26 +822,71 @@ void magInit(void)
 	}
 } // magInit
 
-#ifndef WIN32
-/** get_temp
- *  Pinched from raspi-teletext demo.c
- * @return Four character temperature in degrees C eg. "45.7"
- */
-bool get_temp(char* str)
+uint64_t magCpu(void)
 {
-    FILE *fp;
-    char *pch;
-		char tmp[100];
-
-    fp = popen("/usr/bin/vcgencmd measure_temp", "r");
-    fgets(tmp, 99, fp);
-    pclose(fp);
-    pch = strtok (tmp,"=\n");
-    pch = strtok (NULL,"=\n");
-		strncpy(str,pch,5);
-		return TRUE; // @todo
+	uint64_t total=0;
+	int i;
+	for (i=0;i<8;i++)
+		if (magThread[i])
+			total+=piThreadCpu(magThread[i]);
+	return total;
 }
-#endif
+
+void magReload(void)
+{
+	#ifndef WIN32
+	if (watchFd>=0)
+	{
+		// The watcher does it, so that it can't overlap a single page change
+		if (write(reloadPipe[1],"R",1)<0 && errno!=EAGAIN)
+			fprintf(stderr,"[magReload] Can't ask for a reload: %s\n",strerror(errno));
+		return;
+	}
+	#endif
+	reloadPages();	// No watcher, so nothing else is loading pages
+} // magReload
+
+void magStop(void)
+{
+	int i;
+	unsigned int j;
+	MAGLIST *m;
+	#ifndef WIN32
+	if (watchFd>=0)
+	{
+		pthread_cancel(watchThread);
+		pthread_join(watchThread,NULL);
+		close(watchFd);
+		watchFd=-1;
+		close(reloadPipe[0]);
+		close(reloadPipe[1]);
+		reloadPipe[0]=reloadPipe[1]=-1;
+	}
+	#endif
+	// piStop has been called, so the mag threads finish at the end of the packet they are on
+	for (i=0;i<8;i++)
+	{
+		pthread_mutex_lock(&magList[i].lock);
+		pthread_cond_broadcast(&magList[i].wake);	// Wake any that are waiting for a page
+		pthread_mutex_unlock(&magList[i].lock);
+		bufferInterrupt(&magBuffer[i]);	// and any that are waiting for stream.c
+	}
+	for (i=0;i<8;i++)
+		pthread_join(magThread[i],NULL);
+	// Nobody else is using the pages now
+	for (i=0;i<8;i++)
+	{
+		m=&magList[i];
+		for (j=0;j<256;j++)
+			PageStoreRelease(m->txList[j]);
+		for (j=0;j<m->carouselCount;j++)
+			PageStoreRelease(m->carousel[j].page);
+		free(m->carousel);
+		pthread_cond_destroy(&m->wake);
+		pthread_mutex_destroy(&m->lock);
+		memset(m,0,sizeof(MAGLIST));
+	}
+} // magStop
 
 /** get_time
  *  Pinched from raspi-teletext demo.c
@@ -687,14 +894,9 @@ bool get_temp(char* str)
  */
 bool get_time(char* str)
 {
-    time_t rawtime;
-    struct tm *info;
-
-    time( &rawtime );
-
-    info = localtime( &rawtime );
-
-    strftime(str, 21, "\x02%a %d %b\x03%H:%M/%S", info);
+    CLOCKSNAP clock;
+    clockGet(&clock);
+    memcpy(str, clock.timedate, 21);
 		return TRUE; // @todo
 }
 
@@ -706,14 +908,8 @@ bool get_time(char* str)
  */
 bool get_offset_time(char* str)
 {
-	char strTime[6];
-	// get the time (UTC I think)
-	time_t rawtime;
-	struct tm *info;
-	time( &rawtime );
-
-	// What is our offset in seconds?
-	int offset=((str[3]-'0')*10+str[4]-'0')*30*60; // @todo We really ought to validate this
+	// What is our offset in half hours?
+	int offset=(str[3]-'0')*10+str[4]-'0'; // @todo We really ought to validate this
 	
 	// Is it negative (west of us?)
 	if (str[2]=='-')
@@ -721,50 +917,29 @@ bool get_offset_time(char* str)
 	else
 		if (str[2]!='+') return false; // Must be + or -
 		
-	// Add the offset to the time value
-	rawtime+=offset;
-
-	info = localtime( &rawtime );
-
-	strftime(strTime, 21, "%H:%M", info);
-	strncpy(str,strTime,5);
+	format_offset_time(str,offset);
 	return TRUE; // @todo
 }
 
-#ifndef WIN32
-/** get_net
- *  Pinched from raspi-teletext demo.c
- * @return network address as 20 characters
- * Sample response
- * 3: wlan0    inet 192.168.1.14/24 brd 192.168.1.255 scope global wlan0\       valid_lft forever preferred_lft forever
+/** format_offset_time
+ * \param str : Receives local time plus offset as 5 characters in the form 21:30. Not terminated.
+ * \param halfHours : Offset from local time in half hours
  */
-bool get_net(char* str)
+void format_offset_time(char* str, int halfHours)
 {
-	FILE *fp;
-	char *pch;
-
-	int n;
-	char temp[100];
-	fp = popen("/sbin/ip -o -f inet addr show scope global", "r");
-	fgets(temp, 99, fp);
-	pclose(fp);
-	pch = strtok (temp," \n/");
-	for (n=1; n<4; n++)
-	{
-			pch = strtok (NULL, " \n/");
-	}
-	// If we don't have a connection established, try not to crash
-	if (pch==NULL)
-	{
-		strcpy(str,"IP address????");
-		return FALSE;
-	}
-	strncpy(str,pch,15);
-	return TRUE; // @todo
-	// Can be up to 15 characters long
-	//for (i=strlen(temp2);i<15;i++)
-	//				temp2[i]=' ';
-	//temp2[15]=0;
-	//return TRUE;
+	CLOCKSNAP clock;
+	int minutes;
+	clockGet(&clock);
+
+	// Add the offset to the local time of day
+	minutes=(clock.local.tm_hour*60+clock.local.tm_min+halfHours*30)%(24*60);
+	if (minutes<0)
+		minutes+=24*60;
+
+	str[0]='0'+minutes/600;
+	str[1]='0'+minutes/60%10;
+	str[2]=':';
+	str[3]='0'+minutes%60/10;
+	str[4]='0'+minutes%10;
 }
-#endif
+
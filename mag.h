@@ -8,14 +8,24 @@
 #include <string.h>
 #include <stdbool.h>
 #include <dirent.h> 
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <fcntl.h>
+#endif
 
 #include "thread.h"
 
 // VBIT stuff
 #include "page.h"
+#include "pagestore.h"
+#include "sampler.h"
 #include "packet.h"
 #include "buffer.h"
 #include "delay.h"
+#include "metrics.h"
 
 /// States that each magazine can be in
 #define STATE_BEGIN	0
@@ -37,12 +47,40 @@ void domag(void);
  */
 void magInit(void);
 
-// System status
-bool get_temp(char* str);
+/** magReload - Scan the pages folder again
+ * Every page file is compiled again and pages whose file has gone are dropped.
+ * When the page watcher is running it does the reload, after any changes it has
+ * already been told about, and this returns straight away.
+ */
+void magReload(void);
+
+/** magStop - Wait for the mag threads and the page watcher to finish and free all the pages
+ * Call piStop first.
+ */
+void magStop(void);
+
+/** magCpu - CPU time used by the magazine threads so far
+ * \return Microseconds, all eight threads added together
+ */
+uint64_t magCpu(void);
+
+/** magAddPage - Put a stored page on its magazine
+ * Any page previously loaded from the same file is replaced.
+ * The magazine takes over the reference on sp.
+ * \param sp : A page from PageStoreLoad
+ */
+void magAddPage(STOREDPAGE *sp);
+
+/** magRemovePage - Take the page loaded from filename off the air
+ * \param filename : The page file
+ */
+void magRemovePage(char *filename);
+
+// System status. Temperature and network address come from sampler.c
 bool get_time(char* str);
 bool get_offset_time(char* str);
-bool get_net(char* str);
+void format_offset_time(char* str, int halfHours);
 
-extern bufferpacket magBuffer[9];	// One buffer control block for each magazine (plus one for subtitles and databroadcast!(
+extern bufferpacket magBuffer[8];	// One buffer control block for each magazine, indexed by mag%8
 
 #endif
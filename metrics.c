@@ -0,0 +1,226 @@
+/** ***************************************************************************
+ * Name				: metrics.c
+ * Description       : VBIT Pipeline metrics
+ * Formats the counters that the threads keep, for the status command
+ * and for an optional file that is rewritten every few seconds.
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+
+#include "metrics.h"
+#include "buffer.h"
+#include "mag.h"
+#include "stream.h"
+#include "nu4.h"
+
+METRICS metrics;
+
+static uint64_t started;	/// millis() at metricsInit
+static pthread_t metricsThread;
+static pthread_mutex_t metricsLock=PTHREAD_MUTEX_INITIALIZER;	/// Only for metricsWake
+static pthread_cond_t metricsWake;	/// Signalled by metricsStop
+static uint8_t metricsRunning;
+
+/** latencyAdd - Count one time in a histogram
+ */
+static void latencyAdd(LATENCY *l, uint64_t us)
+{
+	unsigned int b=0;
+	while (us>>b && b<LATENCYBUCKETS-1)
+		b++;
+	metricsAdd(l->bucket[b],1);
+	if (us>metricsGet(l->max))	// Only one thread records
+		metricsSet(l->max,us);
+}
+
+void metricsLatency(packetmeta *meta, uint64_t now)
+{
+	unsigned int source;
+	unsigned int type;
+	uint64_t moved;
+	if (meta->flags & PACKETMETA_QUIET)
+		return;
+	if (meta->flags & PACKETMETA_SUBTITLE)
+		source=LATENCY_SUBTITLE;
+	else if (meta->flags & PACKETMETA_SERVICE)
+		source=LATENCY_SERVICE;
+	else
+		source=meta->mag%8;
+	if (!meta->row)
+		type=LATENCY_HEADER;
+	else if (meta->row<=25)
+		type=LATENCY_ROW;
+	else
+		type=LATENCY_OTHER;
+	moved=meta->moved ? meta->moved : meta->created;
+	latencyAdd(&metrics.source[source][LATENCY_QUEUE],moved-meta->created);
+	latencyAdd(&metrics.source[source][LATENCY_OUTPUT],now-moved);
+	latencyAdd(&metrics.source[source][LATENCY_TOTAL],now-meta->created);
+	latencyAdd(&metrics.type[type][LATENCY_QUEUE],moved-meta->created);
+	latencyAdd(&metrics.type[type][LATENCY_OUTPUT],now-moved);
+	latencyAdd(&metrics.type[type][LATENCY_TOTAL],now-meta->created);
+}
+
+/** latencyFormat - One line for a histogram, if it has anything in it
+ * The percentiles are the top of the bucket that they fall in, so they are at most twice the true value.
+ */
+static size_t latencyFormat(char *str, size_t size, const char *name, const char *stage, LATENCY *l)
+{
+	unsigned long count[LATENCYBUCKETS];
+	unsigned long total=0;
+	unsigned long seen=0;
+	unsigned long max=metricsGet(l->max);
+	unsigned long p50=0, p99=0;
+	int b;
+	for (b=0;b<LATENCYBUCKETS;b++)
+		total+=count[b]=metricsGet(l->bucket[b]);
+	if (!total)
+		return 0;
+	for (b=0;b<LATENCYBUCKETS;b++)
+	{
+		if (seen*2<total && (seen+count[b])*2>=total)
+			p50=(1UL<<b)-1;
+		if (seen*100<total*99 && (seen+count[b])*100>=total*99)
+			p99=(1UL<<b)-1;
+		seen+=count[b];
+	}
+	if (p50>max) p50=max;
+	if (p99>max) p99=max;
+	return snprintf(str,size,"latency.%s.%s p50=%lu p99=%lu max=%lu n=%lu\n",name,stage,p50,p99,max,total);
+}
+
+int metricsFormat(char *str, size_t size)
+{
+	static const char *stages[LATENCYSTAGES]={"queue","output","total"};
+	static const char *types[LATENCYTYPES]={"header","row","other"};
+	char name[12];
+	int stage;
+	size_t n=0;
+	unsigned long writes=metricsGet(metrics.writes);
+	int i;
+	int mag;
+	#define PRINT(...) if (n<size) n+=snprintf(str+n,size-n,__VA_ARGS__)
+	PRINT("uptime=%lu\n",(unsigned long)((millis()-started)/1000));
+	PRINT("stream.level=%u/%u\n",bufferLevel(streamBuffer),streamBuffer->count);
+	for (i=1;i<=8;i++)
+	{
+		mag=i%8;
+		PRINT("mag%d.level=%u/%u mag%d.lines=%lu mag%d.cycle_ms=%lu\n",
+			i,bufferLevel(&magBuffer[mag]),magBuffer[mag].count,
+			i,metricsGet(metrics.magLines[mag]),
+			i,metricsGet(metrics.magCycle[mag]));
+	}
+	PRINT("subtitle.level=%u/%u\n",subtitleLevel(),SUBTITLELANE);
+	PRINT("subtitle.queued=%lu subtitle.dropped=%lu subtitle.skipped_rows=%lu\n",
+		metricsGet(metrics.subtitles),metricsGet(metrics.subtitleDrops),metricsGet(metrics.subtitleSkips));
+	PRINT("subtitle.lines=%lu\n",metricsGet(metrics.subtitleLines));
+	PRINT("service.lines=%lu\n",metricsGet(metrics.serviceLines));
+	PRINT("quiet.lines=%lu\n",metricsGet(metrics.quietLines));
+	PRINT("headers=%lu\n",metricsGet(metrics.headers));
+	PRINT("headers_per_second=%lu\n",metricsGet(metrics.headersPerSecond));
+	PRINT("holds.header=%lu\n",metricsGet(metrics.headerHolds));
+	PRINT("holds.empty=%lu\n",metricsGet(metrics.emptyHolds));
+	PRINT("output.lines=%lu\n",metricsGet(metrics.outputLines));
+	PRINT("output.filler=%lu\n",metricsGet(metrics.fillerLines));
+	PRINT("output.slipped=%lu\n",metricsGet(metrics.slipLines));
+	PRINT("output.writes=%lu\n",writes);
+	PRINT("output.write_us.avg=%lu\n",writes ? metricsGet(metrics.writeMicros)/writes : 0);
+	PRINT("output.write_us.max=%lu\n",metricsGet(metrics.writeMaxMicros));
+	if (pacing!=PACING_OFF)
+	{
+		PRINT("output.fields=%lu\n",metricsGet(metrics.fields));
+		PRINT("output.underruns=%lu\n",metricsGet(metrics.underruns));
+		PRINT("output.overruns=%lu\n",metricsGet(metrics.overruns));
+	}
+	for (i=0;i<LATENCYSOURCES;i++)
+	{
+		if (i<8)
+			snprintf(name,sizeof(name),"mag%d",i ? i : 8);
+		else
+			strcpy(name,i==LATENCY_SUBTITLE ? "subtitle" : "service");
+		for (stage=0;stage<LATENCYSTAGES;stage++)
+			if (n<size) n+=latencyFormat(str+n,size-n,name,stages[stage],&metrics.source[i][stage]);
+	}
+	for (i=0;i<LATENCYTYPES;i++)
+		for (stage=0;stage<LATENCYSTAGES;stage++)
+			if (n<size) n+=latencyFormat(str+n,size-n,types[i],stages[stage],&metrics.type[i][stage]);
+	#undef PRINT
+	return n<size ? n : size-1;
+} // metricsFormat
+
+/** metricsWrite - Replace the metrics file
+ * The new file is written alongside and renamed over the old one so a reader never sees half of it.
+ */
+static void metricsWrite(void)
+{
+	char str[METRICSTEXTSIZE];
+	char tmp[MAXCONFLINE+4];
+	FILE *f;
+	int n=metricsFormat(str,sizeof(str));
+	snprintf(tmp,sizeof(tmp),"%s.new",metricsFile);
+	f=fopen(tmp,"w");
+	if (!f)
+	{
+		fprintf(stderr,"[metricsWrite] Can't write %s\n",tmp);
+		return;
+	}
+	fwrite(str,1,n,f);
+	fclose(f);
+	rename(tmp,metricsFile);
+}
+
+/** metricsDump - Thread that writes the metrics file every metricsInterval seconds
+ */
+static void *metricsDump(void *dummy)
+{
+	struct timespec when;
+	(void)dummy;
+	while (piRunning())
+	{
+		pthread_mutex_lock(&metricsLock);
+		condTimeout(&when,metricsInterval*1000);
+		if (piRunning())
+			pthread_cond_timedwait(&metricsWake,&metricsLock,&when);
+		pthread_mutex_unlock(&metricsLock);
+		metricsWrite();	// One last time on the way out too
+	}
+	return NULL;
+}
+
+void metricsInit(void)
+{
+	started=millis();
+	if (!metricsFile[0])
+		return;
+	condInit(&metricsWake);
+	metricsRunning=!pthread_create(&metricsThread,NULL,metricsDump,NULL);
+}
+
+void metricsStop(void)
+{
+	if (!metricsRunning)
+		return;
+	pthread_mutex_lock(&metricsLock);
+	pthread_cond_signal(&metricsWake);
+	pthread_mutex_unlock(&metricsLock);
+	pthread_join(metricsThread,NULL);
+	metricsRunning=0;
+}
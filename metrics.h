@@ -0,0 +1,146 @@
+/** ***************************************************************************
+ * Description       : VBIT Pipeline metrics
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "thread.h"
+#include "delay.h"
+#include "settings.h"
+#include "buffer.h"
+
+/** Latency histograms. Each packet is timed from when it was made to when it
+ * was moved onto the stream buffer and then to when OutputStream wrote it.
+ * The buckets are powers of two of microseconds.
+ */
+#define LATENCYBUCKETS 24	// Bucket n holds 2^(n-1) to 2^n-1 us. The last one holds everything longer.
+
+// Stages
+#define LATENCY_QUEUE 0		// Made to moved: the wait in the magazine buffer
+#define LATENCY_OUTPUT 1	// Moved to written: the stream buffer and the write
+#define LATENCY_TOTAL 2		// Made to written
+#define LATENCYSTAGES 3
+
+// Sources. 0..7 are the magazines, indexed by mag%8
+#define LATENCY_SUBTITLE 8	// Newfor, timed from the OnAir or OffAir command
+#define LATENCY_SERVICE 9	// Packets that stream.c makes, 8/30
+#define LATENCYSOURCES 10
+
+// Packet types
+#define LATENCY_HEADER 0	// Row 0
+#define LATENCY_ROW 1		// Display rows 1..25
+#define LATENCY_OTHER 2		// 26..31: X/27, X/28, 8/30 etc.
+#define LATENCYTYPES 3
+
+typedef struct _LATENCY_
+{
+	atomic_ulong bucket[LATENCYBUCKETS];
+	atomic_ulong max;	/// Microseconds
+} LATENCY;
+
+/** Counters and gauges for each stage of the pipeline.
+ * Each one is written by a single thread and may be read by any thread,
+ * so relaxed atomics are all that is needed.
+ * The magazine arrays are indexed by mag%8, so magazine 8 is [0].
+ */
+typedef struct _METRICS_
+{
+	// Magazine threads
+	atomic_ulong magCycle[8];		/// Milliseconds the last cycle round the page list took
+	// Stream
+	atomic_ulong magLines[8];		/// Lines sent for each magazine
+	atomic_ulong subtitleLines;		/// Lines sent for subtitles
+	atomic_ulong serviceLines;		/// Lines used by packet 8/30
+	atomic_ulong quietLines;		/// Lines that no magazine had anything for
+	atomic_ulong headers;			/// Header packets sent
+	atomic_ulong headersPerSecond;	/// Headers sent in the last whole second
+	atomic_ulong headerHolds;		/// Magazines held for the rest of a field after a header
+	atomic_ulong emptyHolds;		/// Magazines held for the rest of a field because they ran dry
+	atomic_ulong subtitleSkips;		/// Rows skipped because a subtitle interrupted their page
+	// Newfor
+	atomic_ulong subtitles;			/// Subtitles put on the subtitle lane
+	atomic_ulong subtitleDrops;		/// Subtitles dropped because the lane was full
+	// OutputStream
+	atomic_ulong outputLines;		/// Lines written, including padding
+	atomic_ulong fillerLines;		/// Lines padded out with quiet or filler
+	atomic_ulong slipLines;			/// Lines thrown away to get back in step with the fields of stream.c
+	atomic_ulong writes;			/// Number of writes to stdout
+	atomic_ulong writeMicros;		/// Total time spent in those writes
+	atomic_ulong writeMaxMicros;	/// The longest write
+	atomic_ulong fields;			/// Fields sent by the field clock
+	atomic_ulong underruns;			/// Fields that weren't ready on time
+	atomic_ulong overruns;			/// Field periods missed because the output blocked
+	// Latency. Only OutputStream records these.
+	LATENCY source[LATENCYSOURCES][LATENCYSTAGES];
+	LATENCY type[LATENCYTYPES][LATENCYSTAGES];
+} METRICS;
+
+extern METRICS metrics;
+
+/** metricsAdd - Add to a counter
+ */
+#define metricsAdd(counter,n) atomic_fetch_add_explicit(&(counter),(n),memory_order_relaxed)
+
+/** metricsSet - Set a gauge
+ */
+#define metricsSet(gauge,n) atomic_store_explicit(&(gauge),(n),memory_order_relaxed)
+
+/** metricsGet - Read a counter or gauge
+ */
+#define metricsGet(counter) atomic_load_explicit(&(counter),memory_order_relaxed)
+
+/** metricsLatency - Record the latency of a packet that has just been written
+ * Only call this from one thread. Quiet and filler lines are ignored.
+ * \param meta : The packet's descriptor
+ * \param now : micros() when it was written
+ */
+void metricsLatency(packetmeta *meta, uint64_t now);
+
+// Room for everything that metricsFormat says
+#define METRICSTEXTSIZE 8192
+
+/** metricsFormat - Describe the state of the pipeline
+ * One name=value pair per line.
+ * \param str : Receives the text
+ * \param size : Size of str
+ * \return Number of characters written
+ */
+int metricsFormat(char *str, size_t size);
+
+/** metricsInit - Start writing the metrics to metricsFile every metricsInterval seconds
+ * Does nothing if metricsFile is not set.
+ */
+void metricsInit(void);
+
+/** metricsStop - Stop the metrics file thread. Call piStop first.
+ */
+void metricsStop(void);
+
+#endif
@@ -10,24 +10,68 @@
 
 #include "nu4.h" 
 
-bufferpacket packetCache[1]; // Incoming rows are cached here, and transferred to subtitleBuffer when OnAir 
+static SUBTITLE *lane[SUBTITLELANE];	// The subtitle lane to Stream
+static atomic_uint laneHead;	/// Next place to put. Only the client thread moves it.
+static atomic_uint laneTail;	/// Next to send. Only Stream moves it.
 
-// Packet Subtitles are stored here 
+/** subtitleMag - The magazine of a page
+ * \return 0..7 where 0 is magazine 8
+ */
+static uint8_t subtitleMag(int page)
+{
+	return (page>>8) & 0x07;
+}
 
-uint8_t subtitleCache [SUBTITLEPACKETCOUNT][PACKETSIZE];	/// Storage for 8 packets, 45 bytes per packet. (for packetCache)
+/** subtitleHeader - Encode the header of a subtitle into a slot
+ * Control bits are erase+subtitle. There is no caption. Subtitle pages don't show their header.
+ */
+static void subtitleHeader(SUBTITLE *s, int page)
+{
+	bufferslot *p=&s->packet[0];
+	PacketHeader(p->packet, subtitleMag(page), page & 0xff, 0, 0x4002);
+	memset(p->packet+13,' ',PACKETSIZE-13);
+	Parity(p->packet,13);
+	packetMetaDecode(&p->meta,p->packet);
+	p->meta.flags=PACKETMETA_SUBTITLE;	// Not PACKETMETA_HEADER. It is finished already.
+	s->count=1;
+}
 
-static uint8_t _page;	/// Page number (in hex). This is set by Page Init
-static uint8_t _rowcount; /// Number of rows in this subtitle
-static char packet[PACKETSIZE];
+/** subtitlePut - Put a subtitle on the lane
+ * Only the pointer goes on, so this takes the same time however many rows there are.
+ * Stamped now, so that the latency is measured from the command that sent it.
+ * \return 1 OK, 0 if the lane was full or the subtitle is still on it
+ */
+static uint8_t subtitlePut(SUBTITLE *s)
+{
+	unsigned int head=atomic_load_explicit(&laneHead,memory_order_relaxed);
+	if (head-atomic_load_explicit(&laneTail,memory_order_acquire)>=SUBTITLELANE || atomic_load_explicit(&s->queued,memory_order_acquire))
+	{
+		metricsAdd(metrics.subtitleDrops,1);
+		return 0;
+	}
+	s->sent=0;
+	s->onAir=micros();
+	atomic_store_explicit(&s->queued,1,memory_order_relaxed);
+	lane[head%SUBTITLELANE]=s;
+	atomic_store_explicit(&laneHead,head+1,memory_order_release);	// Publish it to Stream
+	metricsAdd(metrics.subtitles,1);
+	return 1;
+}
 
 /** initNu4
- * @detail Initialise the buffers used by Newfor
+ * @detail Initialise the subtitle lane
  */
 void InitNu4()
 {  
-	bufferInit(packetCache   ,(char*)subtitleCache ,SUBTITLEPACKETCOUNT);  
+	atomic_init(&laneHead,0);
+	atomic_init(&laneTail,0);
 }
 
+void newforInit(NEWFOR *n)
+{
+	n->page=SUBTITLEDEFAULTPAGE;
+	n->loaded=0;
+}
 
 /** 
  * @detail Expect four characters
@@ -57,44 +101,26 @@ int SoftelPageInit(char* cmd)
   n=vbi_unham8(cmd[4]);
   if (n<0 || n>0x0f) return 0x903;
   page+=n;
-  _page=page;
   return page;
 }
 
-void SubtitleOnair(char* response)
+uint8_t SubtitleOnair(NEWFOR *n)
 {
-	// What page is the subtitle on? THIS IS IN THE WRONG PLACE! Ideally we will already have a header and placed it in the cache
-	uint8_t mag;
-	uint8_t page;
-	mag=(_page/0xff) & 0x07;
-	page=_page & 0xff;
-	// First packet needs to be the header. Could well want suppress header too.
-	sprintf(response,"[SubtitleOnair]mag=%1x page=%02x",mag,page);
-	// PacketHeader(packet, mag, page, 0, 0x0002, "test");
-	PacketHeader(packet, mag, page, 0, 0x4002); // Dummy
-	// dumpPacket(packet);
-	bufferPut(&magBuffer[8],packet);
-	// fprintf(stderr,response);
-
-	while (!bufferIsEmpty(packetCache))
-	{
-		bufferMove(&magBuffer[8],packetCache);
-	}
-
+	if (!n->loaded)
+		return 0;	// Nothing new to show
+	n->loaded=0;
+	if (!subtitlePut(&n->slot[n->next]))
+		return 0;
+	n->next^=1;	// Load the other one next time
+	return 1;
 }
-void SubtitleOffair()
+
+void SubtitleOffair(NEWFOR *n)
 {
-// Construct a header for _page with the erase flag set.
-//  
-	uint8_t mag;
-	uint8_t page;
-	mag=(_page/0xff) & 0x07;
-	page=_page & 0xff;
-	// Control bits are erase+subtitle
-	PacketHeader(packet, mag, page, 0, 0x4002);
-	Parity(packet,13);
-	// May want to clear subtitle buffer at the same time
-	bufferPut(&magBuffer[8],packet);
+	if (atomic_load_explicit(&n->clear.queued,memory_order_acquire))
+		return;	// Still going out from last time
+	subtitleHeader(&n->clear,n->page);
+	subtitlePut(&n->clear);
 }
 
 /**
@@ -103,24 +129,69 @@ void SubtitleOffair()
 int GetRowCount(char* cmd)
 {
   int n=vbi_unham8(cmd[1]);
-  if (n>7)
+  if (n<1 || n>SUBTITLEROWS)
 	n=0;
-  _rowcount=n;
   return n;	
 }
 
-/**
- * @brief Save a row of data when a Newfor command is completed
- */
-void saveSubtitleRow(uint8_t mag, uint8_t row, char* cmd)
+uint8_t SubtitleData(NEWFOR *n, int rows, uint8_t *rowAddress, char rowText[][40])
 {
-	char packet[PACKETSIZE]; // A packet for us to fill
-	PacketPrefix((uint8_t*)packet, mag, row);
-	// copy from cmd to the packet
-	strncpy(packet+5,cmd,40);
-	// fix the parity
-	Parity(packet,5);
-	// stuff it in the buffer
-	bufferPut(packetCache,packet); // buffer packets locally
+	SUBTITLE *s=&n->slot[n->next];
+	bufferslot *p;
+	int i;
+	if (atomic_load_explicit(&s->queued,memory_order_acquire))
+	{
+		// The last time this slot went on air it hasn't finished going out. Try the other.
+		if (atomic_load_explicit(&n->slot[n->next^1].queued,memory_order_acquire))
+			return 0;
+		n->next^=1;
+		s=&n->slot[n->next];
+	}
+	subtitleHeader(s,n->page);
+	for (i=0;i<rows;i++)
+	{
+		p=&s->packet[s->count++];
+		PacketPrefix((uint8_t*)p->packet, subtitleMag(n->page), rowAddress[i]);
+		memcpy(p->packet+5,rowText[i],40);
+		Parity(p->packet,5);
+		packetMetaDecode(&p->meta,p->packet);
+		p->meta.flags=PACKETMETA_SUBTITLE;
+	}
+	n->loaded=1;
+	return 1;
+}
 
+uint8_t subtitleReady(void)
+{
+	return atomic_load_explicit(&laneHead,memory_order_acquire)!=atomic_load_explicit(&laneTail,memory_order_relaxed);
+}
+
+uint8_t subtitleMove(bufferpacket *dest, packetmeta *meta, uint8_t flags)
+{
+	unsigned int tail=atomic_load_explicit(&laneTail,memory_order_relaxed);
+	SUBTITLE *s;
+	bufferslot *p;
+	if (tail==atomic_load_explicit(&laneHead,memory_order_acquire))
+		return BUFFER_EMPTY;
+	if (bufferIsFull(dest))
+		return BUFFER_FULL;
+	s=lane[tail%SUBTITLELANE];
+	p=&s->packet[s->sent++];
+	*meta=p->meta;
+	meta->created=s->onAir;
+	meta->moved=micros();
+	meta->flags|=flags;
+	bufferPutMeta(dest,p->packet,meta);
+	if (s->sent>=s->count)
+	{
+		// All gone. The client can load this slot again.
+		atomic_store_explicit(&s->queued,0,memory_order_release);
+		atomic_store_explicit(&laneTail,tail+1,memory_order_release);
+	}
+	return meta->row ? BUFFER_OK : BUFFER_HEADER;
+}
+
+unsigned int subtitleLevel(void)
+{
+	return atomic_load_explicit(&laneHead,memory_order_relaxed)-atomic_load_explicit(&laneTail,memory_order_relaxed);
 }
@@ -7,30 +7,60 @@
 #include "mag.h"
 #include "hamm.h"
 
-/** The buffer is big enough to contain a head and seven rows.
- * The buffer is in two parts. A buffer control block and the actual data
- * The stream buffer is 50 packets
- 
+/** 
  How does this work?
  Newfor data is accepted over a network connection.
  A Newfor command is used to set the page. For the UK this is usually 888.
  Subtitle data is then sent as a complete block of rows.
- As each row is received it gets converted into a transmission ready packet.
- Each packet gets put into a buffer.
- When OnAir is received, all these packets get put onto the output stream called bufferpacket
+ The block is encoded straight away into a subtitle slot: a header with
+ erase and subtitle set, then the rows, all transmission ready.
+ Each connection has two slots. One can be on air while the next is loaded.
+ When OnAir is received, the loaded slot is put on the subtitle lane, which
+ is only a pointer, and the other slot becomes the one to load.
  From there it gets picked up by the stream process and out on air
- 
  */
  
-#define SUBTITLEPACKETCOUNT 8
+#define SUBTITLEPACKETCOUNT 8	// A header and seven rows
+#define SUBTITLEROWS 7	// Most rows in a Newfor subtitle
+#define SUBTITLEDEFAULTPAGE 0x888	// Until Page Init says otherwise
+
+/** The subtitle lane. Stream sends what is on it ahead of all the magazines.
+ * It is bounded so that subtitles can't pile up and go out late.
+ */
+#define SUBTITLELANE 4
 
-extern bufferpacket packetCache[1]; // Commands are read into here, and transferred out when OnAir 
+/** A subtitle, encoded and ready to send
+ */
+typedef struct _SUBTITLE_
+{
+	atomic_uint queued;		/// Set while it is on the lane. Stream clears it once the last packet has gone.
+	unsigned int count;		/// Number of packets, header first
+	unsigned int sent;		/// Packets that Stream has sent. Only Stream uses it.
+	uint64_t onAir;			/// micros() when OnAir put it on the lane
+	bufferslot packet[SUBTITLEPACKETCOUNT];
+} SUBTITLE;
+
+/** The Newfor state of one connection
+ */
+typedef struct _NEWFOR_
+{
+	int page;				/// Set by Page Init
+	SUBTITLE slot[2];		/// One to load while the other is on air
+	uint8_t next;			/// The slot that Subtitle Data loads and OnAir sends
+	uint8_t loaded;			/// Set if slot[next] has a subtitle that hasn't gone on air
+	SUBTITLE clear;			/// The header that OffAir sends
+} NEWFOR;
 
 /** InitNu4
- * Initialise the subtitle buffer
+ * Initialise the subtitle lane
  */
 void InitNu4();
 
+/** newforInit - Set up the Newfor state of a new connection
+ * The slots may still be on the lane from an earlier connection, so they are left alone.
+ */
+void newforInit(NEWFOR *n);
+
  /**
  * @detail Expect four characters
  * 1: Ham 0 (always 0x15)
@@ -45,20 +75,23 @@ void InitNu4();
 #define ACK 0x06
 #define NACK 0x15
 
-char subs[(40+1)*7]; // One byte for row number plus 40 bytes, seven times.
- 
+/**
+ * @param cmd The Page Init command and its four hammed bytes
+ * @return The page number, or 0x900 or more if it is invalid
+ */
 int SoftelPageInit(char* cmd);
 
 /** 
- * @brief Put the previously loaded subtitle to the previously select page
- * @param response String message to send back to the client 
+ * @brief Put the loaded subtitle on air
+ * If the subtitle lane is full the subtitle is dropped.
+ * @return 1 OK, 0 if there was nothing loaded or it was dropped
  */ 
-void SubtitleOnair(char* response);
+uint8_t SubtitleOnair(NEWFOR *n);
 
 /** 
- * Clear down subtitles immediately
+ * Clear down subtitles on the page immediately
  */ 
-void SubtitleOffair();
+void SubtitleOffair(NEWFOR *n);
 
 /**
  * Start of a Subtitle Data command
@@ -67,8 +100,33 @@ void SubtitleOffair();
 int GetRowCount(char* cmd);
 
 /**
- * Creates a packet of of Newfor data.
+ * @brief Encode a complete Subtitle Data block, ready for OnAir
+ * It replaces a loaded subtitle that never went on air.
+ * @param rows Number of rows 1..SUBTITLEROWS
+ * @param rowAddress The row numbers
+ * @param rowText 40 characters for each row
+ * @return 1 OK, 0 if both slots are still waiting to go out
+ */
+uint8_t SubtitleData(NEWFOR *n, int rows, uint8_t *rowAddress, char rowText[][40]);
+
+// Stream's end of the subtitle lane
+
+/** subtitleReady - Is there a subtitle to send?
+ * @return 1 if there is
+ */
+uint8_t subtitleReady(void);
+
+/** subtitleMove - Send the next packet of the subtitle at the front of the lane
+ * @param dest The stream buffer
+ * @param meta Receives the descriptor of the packet that was sent
+ * @param flags PACKETMETA_ flags to add to the packet, eg. PACKETMETA_FIELDSTART
+ * @return BUFFER_HEADER, BUFFER_OK for a row, BUFFER_FULL or BUFFER_EMPTY
+ */
+uint8_t subtitleMove(bufferpacket *dest, packetmeta *meta, uint8_t flags);
+
+/** subtitleLevel
+ * @return The number of subtitles on the lane
  */
-void saveSubtitleRow(uint8_t mag, uint8_t row,char* cmd);
+unsigned int subtitleLevel(void);
 
 #endif
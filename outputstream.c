@@ -1,16 +1,220 @@
 #include "outputstream.h"
 
-char mydata[45];
+static uint8_t discard;	/// Set by outputDiscard. The fields go nowhere.
+static char field[OUTPUTFIELDS*MAXFIELDLINES*42];	/// The lines of the fields being assembled
+static packetmeta lineMeta[OUTPUTFIELDS*MAXFIELDLINES];	/// Descriptors of the lines being assembled
+static char quiet[PACKETSIZE];	/// A blank line, for the lines that the line map leaves out
+static uint8_t parity;	/// 0 when the consumer of stdout takes an odd field next, 1 for an even one
+
+/** padLine - Mark a line as padding so that it isn't timed
+ */
+static void padLine(unsigned int line)
+{
+	lineMeta[line].flags=PACKETMETA_QUIET;
+}
+
+/** assembleField - Fill in the lines of the next field, as the line map lays it out
+ * Lines that the map leaves out are blank and don't use up a packet from stream.c.
+ * Once stream.c runs out, the rest of the teletext lines are padded.
+ * A field only ever holds the lines of one field of stream.c, so the headers stay
+ * apart from their rows. If a field had to be padded, the lines of it that turn up late
+ * are thrown away, and the next field starts with the next PACKETMETA_FIELDSTART.
+ * stream.c fills its fields to fit the odd or even line map, and says which with
+ * PACKETMETA_EVEN. A field of stream.c that doesn't match the field the consumer
+ * takes next waits, and this field is padded instead.
+ * \param base : The first line of the field in the batch
+ * \param pad : The packet to pad with
+ * \param until : micros() after which stream.c has run out. 0 to wait for the first line
+ *               for as long as it takes, and a field period after that for the rest.
+ * \return The number of packets taken from stream.c
+ */
+static unsigned int assembleField(unsigned int base, char *pad, uint64_t until)
+{
+	char mydata[PACKETSIZE];
+	packetmeta meta;
+	uint64_t now;
+	unsigned int taken=0;
+	uint8_t empty=0;	// Set once stream.c has run out
+	uint8_t i;
+	for (i=0;i<fieldLineCount[parity];i++)
+	{
+		if (!(fieldLineMap[parity]>>i & 1))
+		{
+			padLine(base+i);	// Not a teletext line
+			memcpy(&field[42*(base+i)],&quiet[3],42);
+			continue;
+		}
+		while (!empty)
+		{
+			if (bufferPeekMeta(streamBuffer,&meta)==BUFFER_EMPTY)
+			{
+				// Buffer under-run. Give stream.c until the field is due to catch up.
+				now=micros();
+				if (!piRunning() || (until && now>=until))
+					empty=1;
+				else
+					bufferWaitData(streamBuffer,until ? (until-now)/1000+1 : FIELDPERIOD);
+				continue;
+			}
+			if (meta.flags & PACKETMETA_FIELDSTART)
+			{
+				if (taken || (meta.flags & PACKETMETA_EVEN ? 1 : 0)!=parity)
+					empty=1;	// The next field mustn't start part way through this one, nor in the wrong field
+				break;
+			}
+			if (taken)
+				break;	// The rest of this field
+			// Left over from a field that was padded. It would be in the wrong field now.
+			bufferGetMeta(streamBuffer,mydata,&meta);
+			metricsAdd(metrics.slipLines,1);
+		}
+		if (empty)
+		{
+			padLine(base+i);
+			memcpy(&field[42*(base+i)],&pad[3],42);
+		}
+		else
+		{
+			bufferGetMeta(streamBuffer,mydata,&lineMeta[base+i]);
+			memcpy(&field[42*(base+i)],&mydata[3],42);
+			if (!until)
+				until=micros()+FIELDPERIOD*1000;	// The field has started. The rest must follow soon.
+			taken++;
+		}
+	}
+	return taken;
+}
+
+/** assembleBatch - Fill in the next OUTPUTFIELDS fields, padding with quiet lines
+ * \param until : As for assembleField
+ * \return The number of lines in the batch, or 0 if stream.c had nothing for it
+ */
+static unsigned int assembleBatch(uint64_t until)
+{
+	unsigned int count=0;
+	unsigned int taken;
+	uint8_t i;
+	for (i=0;i<OUTPUTFIELDS;i++)
+	{
+		taken=assembleField(count,quiet,until);
+		if (!taken && !piRunning())
+			break;	// Nothing left when stopping. The field isn't sent.
+		metricsAdd(metrics.fillerLines,streamLines[parity]-taken);
+		count+=fieldLineCount[parity];
+		parity^=1;
+	}
+	return count;
+}
+
+/** writeField - Send a batch of fields to stdout in one write
+ * Then the latency of each packet in it is recorded.
+ * \param data : count lines of 42 bytes. lineMeta describes them.
+ */
+static void writeField(char *data, unsigned int count)
+{
+	uint64_t start;
+	uint64_t now;
+	unsigned long took;
+	unsigned int i;
+	metricsAdd(metrics.outputLines,count);
+	start=micros();
+	if (!discard)
+	{
+		fwrite(data,42,count,stdout);
+		fflush(stdout);	// One write per batch, so the consumer never sees part of a field
+	}
+	now=micros();
+	took=now-start;
+	metricsAdd(metrics.writes,1);
+	metricsAdd(metrics.writeMicros,took);
+	if (took>metricsGet(metrics.writeMaxMicros))	// Only this thread sets it
+		metricsSet(metrics.writeMaxMicros,took);
+	for (i=0;i<count;i++)
+		metricsLatency(&lineMeta[i],now);
+}
+
+void outputDiscard(void)
+{
+	discard=1;
+}
+
+unsigned long outputLines(void)
+{
+	return metricsGet(metrics.outputLines);
+}
+
+/** pacedOutput - Write exactly one field per field period
+ * The field clock is monotonic and counts from the start, so it doesn't drift.
+ * Each field is assembled during the period before it is due, so a buffer that is
+ * empty for a moment doesn't cut it short. Lines that stream.c hasn't made by the
+ * time the field is due are sent as filler, and the field after starts at the next
+ * field of stream.c.
+ * If the output falls more than a field behind, the missed fields are skipped
+ * and counted rather than sent in a burst. The odd and even fields still alternate.
+ */
+static void pacedOutput(void)
+{
+	char filler[PACKETSIZE];
+	unsigned int taken;
+	uint64_t due;
+	uint64_t fields=0;	// Field periods since start
+	uint64_t late;
+	uint64_t start=micros();
+	// A field period is num/den microseconds
+	uint64_t num=pacing==PACING_5994HZ ? 1001000 : 1000000;
+	uint64_t den=pacing==PACING_5994HZ ? 60 : 50;
+	PacketFiller((uint8_t*)filler);
+	Parity(filler,5);
+	while (piRunning())
+	{
+		due=start+fields*num/den;
+		taken=assembleField(0,filler,due);
+		delayUntil(due);
+		if (taken<streamLines[parity])
+		{
+			metricsAdd(metrics.underruns,1);
+			metricsAdd(metrics.fillerLines,streamLines[parity]-taken);
+		}
+		writeField(field,fieldLineCount[parity]);
+		parity^=1;
+		metricsAdd(metrics.fields,1);
+		fields++;
+		// Which field period are we in now?
+		late=(micros()-start)*den/num;
+		if (late>fields)
+		{
+			metricsAdd(metrics.overruns,late-fields);
+			fields=late;
+		}
+	}
+}
+
+void outputReport(FILE *f)
+{
+	if (pacing==PACING_OFF)
+		return;
+	fprintf(f,"[outputReport] %lu fields at %s Hz, %lu underruns, %lu overruns\n",
+		metricsGet(metrics.fields),pacing==PACING_5994HZ ? "59.94" : "50",
+		metricsGet(metrics.underruns),metricsGet(metrics.overruns));
+}
 
 PI_THREAD (OutputStream)
 {
+	unsigned int count;	// Lines in the batch
 	#ifdef WIN32
 	_setmode(_fileno(stdout), _O_BINARY); // binary mode stdout to avoid pesky line ending conversion
 	#endif
-	while(1)
+	PacketQuiet((uint8_t*)quiet);
+	if (pacing!=PACING_OFF)
 	{
-		// Loop if we have a buffer under-run
-		while (bufferGet(streamBuffer,mydata)==BUFFER_EMPTY) delay(10);
-		fwrite(&mydata[3],1,42,stdout);
+		pacedOutput();
+		return NULL;
 	}
+	while (piRunning())
+		if ((count=assembleBatch(0)))
+			writeField(field,count);
+	// Shutting down. Send whatever is left, padding the last field out. 1 is long gone, so there is no waiting.
+	while ((count=assembleBatch(1)))
+		writeField(field,count);
+	return NULL;
 }
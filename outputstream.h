@@ -13,6 +13,7 @@
 // VBIT
 #include "buffer.h"
 #include "vbit.h"
+#include "metrics.h"
 
 
 /** outputstream is a thread that 
@@ -20,6 +21,26 @@
 2) sources packets to stdout
 */
 PI_THREAD (OutputStream);
+
+/** outputDiscard - Throw the fields away instead of writing them to stdout
+ * For benchmarking. Call before the OutputStream thread starts.
+ */
+void outputDiscard(void);
+
+/** outputLines - Lines that OutputStream has sent so far, including padding
+ */
+unsigned long outputLines(void);
+
+/** outputReport - Print the field clock counts, if the output is paced
+ * \param f : Where to print them
+ */
+void outputReport(FILE *f);
+
+// Number of fields that are assembled and then written to stdout in one go
+#define OUTPUTFIELDS 1
+// How long to wait for stream.c (ms) before padding out a part field
+#define FIELDPERIOD 20
+
 // #define STREAMBUFFERSIZE 50
 extern bufferpacket streamBuffer[1];
 
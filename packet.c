@@ -39,7 +39,6 @@
  *****************************************************************************/ 
 #include "packet.h"
 
-double calculateMJD(int year, int month, int day);
 
 void dumpPacket(char* packet)
 {
@@ -145,10 +144,11 @@ void copyFL(char *packet, char *textline, unsigned char mag)
 	unsigned long nLink;
 	// add the designation code
 	char *ptr;
-	char *p;
+	uint8_t nib[37];	// Designation code and six links before they are hammed. Long enough for HamEncode.
+	uint8_t *p;
 	uint8_t i,j;
-	p=packet+5;
-	*p++=HamTab[0];	// Designation code 0
+	p=nib;
+	*p++=0;	// Designation code 0
 	mag&=0x07;		// Mask the mag just in case. Keep it valid
 	
 	// add the link control byte. This will allow row 24 to show.
@@ -167,6 +167,7 @@ void copyFL(char *packet, char *textline, unsigned char mag)
 		for (j=0;j<6 && ((*textline++)!=',');j++);
 		if (*(textline-1)!=',')
 		{
+			HamEncode((uint8_t*)packet+5,nib,p-nib);	// Keep the links we got
 			return; // failed :-(
 		}
 		// page numbers are hex
@@ -181,17 +182,18 @@ void copyFL(char *packet, char *textline, unsigned char mag)
 		
 		// calculate the relative magazine
 		char cRelMag=(nLink/0x100 ^ mag);
-		*p++=HamTab[nLink & 0xF];			// page units
-		*p++=HamTab[(nLink & 0xF0) >> 4];	// page tens
-		*p++=HamTab[0xF];									// subcode S1
-		*p++=HamTab[((cRelMag & 1) << 3) | 7];
-		*p++=HamTab[0xF];
-		*p++=HamTab[((cRelMag & 6) << 1) | 3];
+		*p++=nLink & 0xF;			// page units
+		*p++=(nLink & 0xF0) >> 4;	// page tens
+		*p++=0xF;									// subcode S1
+		*p++=((cRelMag & 1) << 3) | 7;
+		*p++=0xF;
+		*p++=((cRelMag & 6) << 1) | 3;
 		//if (mag==1)
 		//{
 //			printf("[copyFL]mag 1 link:%X, cRelMag=%d\n",nLink,cRelMag);
 		//}
 	}	
+	HamEncode((uint8_t*)packet+5,nib,sizeof(nib));
 } // copyFL
 
 
@@ -202,12 +204,9 @@ void copyFL(char *packet, char *textline, unsigned char mag)
  */
 void Parity(char *packet, uint8_t offset)
 {
-	int i;
 	//uint8_t c;
-	for (i=offset;i<PACKETSIZE;i++)
-	{		
-		packet[i]=ParTab[(uint8_t)(packet[i]&0x7f)];
-	}
+	if (offset<PACKETSIZE)
+		ParityEncode((uint8_t*)packet+offset,PACKETSIZE-offset);	// The whole row in one go
 	/* DO NOT REVERSE for Raspi
 	for (i=0;i<PACKETSIZE;i++)
 	{
@@ -267,6 +266,7 @@ void PacketHeader(char *packet ,unsigned char mag, unsigned char page, unsigned
 			unsigned int control)
 {
 	uint8_t cbit;
+	// Only eight bytes, so HamTab is quicker than HamEncode here
 	PacketPrefix((uint8_t*)packet,mag,0);
 	packet[5]=HamTab[page%0x10];
 	packet[6]=HamTab[page/0x10];
@@ -315,14 +315,9 @@ void PageEnhancementDataPacket(char *packet, int mag, int row, int designationCo
 // The int is repacked with parity bits  
 void SetTriplet(char *packet, int ix, int triplet)
 {
-	fprintf(stderr,"SetTriplet");
-	uint8_t t[4];
 	if (ix<1) return;
-	vbi_ham24p(t,triplet);
 	// Now stuff the result in the packet
-	packet[ix*3+3]=t[0];
-	packet[ix*3+4]=t[1];
-	packet[ix*3+5]=t[2];
+	Ham24Encode((uint8_t*)packet+ix*3+3,(unsigned int*)&triplet,1);
 }
 
 // generate packet 8/30
@@ -333,12 +328,9 @@ void Packet30(uint8_t *packet, uint8_t format, char* status)
 {
 	uint8_t *p;
 	uint8_t c;
-	time_t timeRaw;
-	struct tm * tempTime;
-	time_t timeLocal;
-	time_t timeUTC;
+	CLOCKSNAP clock;	// The time service has done the conversions already
 	int offsetHalfHours;
-	int year, month, day, hour, minute, second;
+	int hour, minute, second;
 	long modifiedJulianDay;
 	int statusLength;
 	
@@ -376,11 +368,8 @@ void Packet30(uint8_t *packet, uint8_t format, char* status)
 		c = (c & 0x55) << 1 | (c & 0xAA) >> 1;
 		*p++=c;
 		
-		/* calculate number of seconds local time is offset from UTC */
-		timeRaw = time(NULL);
-		timeLocal = mktime(localtime(&timeRaw));
-		timeUTC = mktime(gmtime(&timeRaw));
-		offsetHalfHours = difftime(timeLocal, timeUTC) / 1800;
+		clockGet(&clock);
+		offsetHalfHours = clock.offsetHalfHours;
 		//fprintf(stderr,"Difference in half hours: %d\n", offsetHalfHours);
 		
 		// time offset code -bits 2-6 half hours offset from UTC, bit 7 sign bit
@@ -388,16 +377,11 @@ void Packet30(uint8_t *packet, uint8_t format, char* status)
 		*p++ = ((offsetHalfHours < 0) ? 0xC1 : 0x81) | ((abs(offsetHalfHours) & 0x1F) << 1);
 		
 		// get the time current UTC time into separate variables
-		tempTime = gmtime(&timeRaw);
-		year = tempTime->tm_year + 1900;
-		month = tempTime->tm_mon + 1;
-		day = tempTime->tm_mday;
-		hour = tempTime->tm_hour;
-		minute = tempTime->tm_min;
-		second = tempTime->tm_sec;
+		hour = clock.utc.tm_hour;
+		minute = clock.utc.tm_min;
+		second = clock.utc.tm_sec;
 		
-		//fprintf(stderr,"y %d, m %d, d %d\n", year, month, day);
-		modifiedJulianDay = calculateMJD(year, month, day);
+		modifiedJulianDay = clock.mjd;
 		//fprintf(stderr,"Modified Julian day: %d\n", modifiedJulianDay);
 		// generate five decimal digits of modified julian date decimal digits and increment each one.
 		*p++ = (modifiedJulianDay % 100000 / 10000 + 1);
@@ -427,11 +411,3 @@ void Packet30(uint8_t *packet, uint8_t format, char* status)
 	return;
 }
 
-double calculateMJD(int year, int month, int day){
-	// calculate modified julian day number
-	int a, m, y;
-	a = (14 - month) / 12;
-	y = year + 4800 - a;
-	m = month + (12 * a) - 3;
-	return day + ((153 * m + 1)/5) + (365 * y) + (y / 4) - (y / 100) + (y / 400) - 32045 - 2400000.5;
-}
@@ -15,6 +15,8 @@
 #include <stdlib.h>     /* strtol */
 #include <time.h>
 #include "hamm.h"
+#include "encode.h"
+#include "clock.h"
 #include "settings.h"
 
 /** copyOL - Copy Output Line
@@ -50,6 +50,7 @@ static void put_rc (FRESULT rc)
 uint8_t ParseLine(PAGE *page, char *str)
 {
 	int32_t n;
+	double seconds;
 	// TODO: More input checking
 //	printf("[ParseLine] Parsing %s\n",str);
 	if (str[0]==0) return 0;	// Nothing to parse
@@ -102,8 +103,9 @@ uint8_t ParseLine(PAGE *page, char *str)
 		break;
 	case 'C': // CT,nn,<T|C> - cycle time
 		page->timerMode='T';	// C is not implemented and was a daft idea in any case
-		// get the nn which we expect to start at str[3]
-		page->time=strtol(&str[3],NULL,0);
+		// get the nn which we expect to start at str[3]. Fractions of a second are allowed, eg. CT,0.5,T
+		seconds=strtod(&str[3],NULL);
+		page->time=seconds>0 ? seconds*1000 : 0;
 		break;
 	case 'S': // SP - filename or SC - subcode
 		// Subcode is HEX! 0000..3F7F
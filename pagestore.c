@@ -0,0 +1,324 @@
+/** ***************************************************************************
+ * Name				: pagestore.c
+ * Description       : VBIT In-memory store of pre-encoded teletext pages
+ * Each tti file is parsed once into the packets that go on air:
+ * header, X/28 (RE), rows and X/27 fastext. The magazine threads
+ * send straight from memory, so the file is only read again when it changes.
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+
+// #define _DEBUG_
+
+#include "pagestore.h"
+
+/** addPacket - Make room for one more packet on the stored page
+ * \return The new packet or NULL if we ran out of memory
+ */
+static STOREDPACKET *addPacket(STOREDPAGE *sp, unsigned int *capacity)
+{
+	STOREDPACKET *p;
+	if (sp->packetCount>=*capacity)
+	{
+		*capacity=*capacity ? *capacity*2 : 32;
+		p=realloc(sp->packet,*capacity*sizeof(STOREDPACKET));
+		if (!p) return NULL;
+		sp->packet=p;
+	}
+	p=&sp->packet[sp->packetCount++];
+	p->row=0;
+	p->dynamic=0;
+	p->token=0;
+	return p;
+}
+
+/** addToken - Record a token of pkt and blank it out of text so that it is not found again
+ * \param text : The row as a string, indexed from the start of the packet
+ * \param at : Where the token is in text
+ * \return 0 OK, 1 out of memory
+ */
+static uint8_t addToken(STOREDPAGE *sp, STOREDPACKET *pkt, unsigned int *capacity, char *text, char *at, uint8_t type, uint8_t length, int16_t arg)
+{
+	ROWTOKEN *t;
+	if (sp->tokenCount>=*capacity)
+	{
+		*capacity=*capacity ? *capacity*2 : 16;
+		t=realloc(sp->token,*capacity*sizeof(ROWTOKEN));
+		if (!t) return 1;
+		sp->token=t;
+	}
+	if (!pkt->dynamic)
+		pkt->token=sp->tokenCount;
+	t=&sp->token[sp->tokenCount++];
+	t->type=type;
+	t->offset=at-text;
+	t->length=t->offset+length>PACKETSIZE ? PACKETSIZE-t->offset : length;	// A world time can hang off the end
+	t->arg=arg;
+	pkt->dynamic++;
+	memset(at,' ',length);
+	return 0;
+}
+
+/** findTokens - Locate the system tokens on a row
+ * The tokens are searched for in the same order and with the same rules that
+ * used to be applied on every transmission, so the rows come out the same.
+ * \return 0 OK, 1 out of memory
+ */
+static uint8_t findTokens(STOREDPAGE *sp, STOREDPACKET *pkt, unsigned int *capacity)
+{
+	char text[PACKETSIZE+5];	// The row as a string, with spare nulls so that no token can run off the end
+	char *at;
+	uint8_t r=0;
+	memcpy(text,pkt->packet,PACKETSIZE);
+	memset(text+PACKETSIZE,0,5);
+	if ((at=strstr(text+5,"%%%T")))
+		r|=addToken(sp,pkt,capacity,text,at,TOKEN_TEMP,4,0);
+	if ((at=strstr(text+5,"%%%%%%%%%%%%timedate")))
+		r|=addToken(sp,pkt,capacity,text,at,TOKEN_TIMEDATE,20,0);
+	// As many world times as there are. %t+hh with hh in half hours.
+	while (!r && ((at=strstr(text+5,"%t+")) || (at=strstr(text+5,"%t-"))))
+	{
+		int16_t offset=(at[3]-'0')*10+at[4]-'0'; // @todo We really ought to validate this
+		r|=addToken(sp,pkt,capacity,text,at,TOKEN_OFFSETTIME,5,at[2]=='-' ? -offset : offset);
+	}
+	if ((at=strstr(text+5,"%%%%%%%%%%%%%%n")))
+		r|=addToken(sp,pkt,capacity,text,at,TOKEN_NET,15,0);
+	if ((at=strstr(text+5,"%%%V")))
+		r|=addToken(sp,pkt,capacity,text,at,TOKEN_VERSION,4,0);
+	return r;
+}
+
+/** addSubpage - Start a new subpage using the meta data parsed so far
+ * The header packet and, if the page asks for it, the X/28 packet are encoded here.
+ * \return 0 OK, 1 out of memory
+ */
+static uint8_t addSubpage(STOREDPAGE *sp, PAGE *p, unsigned int *capacity)
+{
+	SUBPAGE *s;
+	STOREDPACKET *pkt;
+	unsigned int triplet[13];
+	int i;
+	s=realloc(sp->subpage,(sp->subpageCount+1)*sizeof(SUBPAGE));
+	if (!s) return 1;
+	sp->subpage=s;
+	s=&sp->subpage[sp->subpageCount++];
+	s->subcode=p->subcode;
+	s->control=p->control;
+	s->time=p->time;
+	s->region=p->region;
+	s->first=sp->packetCount;
+	s->count=0;
+
+	// The header. Note that we force parallel transmission by ensuring that C11 is clear
+	// The header packet isn't quite finished. bufferMove adds the dynamic elements, page, date, clock etc.
+	pkt=addPacket(sp,capacity);
+	if (!pkt) return 1;
+	PacketHeader(pkt->packet,p->mag,p->page,p->subcode,p->control & ~0x0040);
+	s->count++;
+
+	/** @todo I suspect that the page enhancements are reversed or something.
+	 *  Also the RE command appears to be in hex which probably isn't what we want.
+	 */
+	if (p->region>0 && p->region<=0x0f) // Only send this packet if the page asks for it with a non zero RE command
+	{
+		pkt=addPacket(sp,capacity);
+		if (!pkt) return 1;
+		pkt->row=28;
+		PageEnhancementDataPacket(pkt->packet, p->mag, 28,0);
+		// Triplet 1 ETSI 300706 page 30. Also see section 9.4.2.1
+		// 1..4 Page function. 0 for a standard teletext page.
+		// 5..7 Page coding. 0 for 7 bit coding.
+		// 8..14 G0/G2/Nat opt. Bits are in 14..11
+		triplet[0]=p->region<<10; // Not reversed
+		for (i=1;i<13;i++)
+			triplet[i]=0;
+		Ham24Encode((uint8_t*)pkt->packet+6,triplet,13);	// Triplets 1 to 13
+		Parity(pkt->packet,50);	// 50 ensures that we only reverse bytes. Parity would mess up Ham24/8
+		s->count++;
+	}
+	return 0;
+}
+
+/** compilePage - Parse a tti file into sp
+ * sp must be zeroed on entry. On failure sp may hold partial allocations.
+ * \return 0 OK, 1 Fail
+ */
+static uint8_t compilePage(STOREDPAGE *sp, char *filename)
+{
+	const uint16_t MAXLINE=200;
+	char str[MAXLINE];
+	FILE *file;
+	PAGE *p=&sp->page;
+	STOREDPACKET *pkt;
+	SUBPAGE *s=NULL;	// The subpage that rows are being added to
+	unsigned int capacity=0;
+	unsigned int tokenCapacity=0;
+	uint8_t row;
+	struct stat st;
+	int ch;
+
+	file=fopen(filename,"rb");
+	if (!file) return 1;
+	if (!fstat(fileno(file),&st))
+	{
+		sp->mtime=st.st_mtime;
+		sp->size=st.st_size;
+	}
+	ClearPage(p);
+	// If the file has a UTF-8 header, we should get rid of it.
+	ch=getc(file);
+	if (ch==0xEF)
+	{
+		ch=getc(file); // 0xBB
+		ch=getc(file); // 0xBF
+	}
+	else
+		rewind(file);
+	while (fgets(str,MAXLINE,file))
+	{
+		if ((str[0]=='O' || str[0]=='F') && str[1]=='L' && str[2]==',')
+		{
+			// The first row of a subpage. Everything up to here was meta data for it.
+			if (!s)
+			{
+				if (addSubpage(sp,p,&capacity)) break;
+				s=&sp->subpage[sp->subpageCount-1];
+			}
+			pkt=addPacket(sp,&capacity);
+			if (!pkt) break;
+			if (str[0]=='O')
+			{
+				row=copyOL(pkt->packet,str);
+				if (!row || row>31) // OL,0 or junk. Don't transmit it.
+				{
+					sp->packetCount--;
+					continue;
+				}
+				PacketPrefix((uint8_t*)pkt->packet, p->mag, row);
+				if (row<26) // don't mess with parity for packets that would be hammed
+				{
+					if (memchr(pkt->packet+5,'%',PACKETSIZE-5) && findTokens(sp,pkt,&tokenCapacity))
+						break;
+					Parity(pkt->packet,5);	// Token bytes get their parity when they are filled in
+				}
+			}
+			else	// Fastext links
+			{
+				row=27;
+				copyFL(pkt->packet,str,p->mag);
+				PacketPrefix((uint8_t*)pkt->packet,p->mag,27); // X/27/0
+				Parity(pkt->packet,5);
+			}
+			pkt->row=row;
+			s->count++;
+		}
+		else
+		{
+			// A new page number or subcode after some rows starts the next subpage
+			if (s && ((str[0]=='P' && str[1]=='N') || (str[0]=='S' && str[1]=='C')))
+				s=NULL;
+			ParseLine(p,str); // Lines we don't understand are skipped
+		}
+	}
+	fclose(file);
+	if (p->mag<1 || p->mag>8 || !sp->subpageCount)
+	{
+		#ifdef _DEBUG_
+		fprintf(stderr,"[compilePage] Not a valid page %s\n",filename);
+		#endif
+		return 1;
+	}
+	strncpy(p->filename,filename,sizeof(p->filename)-1);
+	p->filename[sizeof(p->filename)-1]=0;
+	return 0;
+} // compilePage
+
+/** releasePage - Free everything that a stored page points to
+ */
+static void releasePage(STOREDPAGE *sp)
+{
+	free(sp->filename);
+	free(sp->subpage);
+	free(sp->packet);
+	free(sp->token);
+}
+
+STOREDPAGE *PageStoreLoad(char *filename)
+{
+	STOREDPAGE *sp;
+	sp=calloc(1,sizeof(STOREDPAGE));
+	if (!sp) return NULL;
+	if (compilePage(sp,filename) || !(sp->filename=strdup(filename)))
+	{
+		releasePage(sp);
+		free(sp);
+		return NULL;
+	}
+	sp->refs=1;
+	return sp;
+}
+
+uint8_t PageStoreRefresh(STOREDPAGE *sp)
+{
+	STOREDPAGE fresh;
+	struct stat st;
+	if (stat(sp->filename,&st))
+		return 1;	// The file has been deleted
+	if (st.st_mtime==sp->mtime && st.st_size==sp->size)
+		return 0;	// Nothing changed
+	#ifdef _DEBUG_
+	fprintf(stderr,"[PageStoreRefresh] Reloading %s\n",sp->filename);
+	#endif
+	memset(&fresh,0,sizeof(fresh));
+	if (compilePage(&fresh,sp->filename))
+	{
+		releasePage(&fresh);	// filename is still NULL so this only frees the packets
+		return 1;
+	}
+	// Swap the new packets in and keep the filename and holders
+	fresh.filename=sp->filename;
+	fresh.refs=sp->refs;
+	sp->filename=NULL;
+	releasePage(sp);
+	*sp=fresh;
+	return 0;
+}
+
+void PageStoreFree(STOREDPAGE *sp)
+{
+	if (!sp) return;
+	releasePage(sp);
+	free(sp);
+}
+
+void PageStoreHold(STOREDPAGE *sp)
+{
+	sp->refs++;
+}
+
+void PageStoreRelease(STOREDPAGE *sp)
+{
+	if (!sp) return;
+	if (sp->refs>1)
+		sp->refs--;
+	else
+		PageStoreFree(sp);
+}
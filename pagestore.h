@@ -0,0 +1,130 @@
+/** ***************************************************************************
+ * Description       : VBIT In-memory store of pre-encoded teletext pages
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+#ifndef _PAGESTORE_H_
+#define _PAGESTORE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "page.h"
+#include "packet.h"
+
+/** A page store compiles a tti file once into transmission ready packets.
+ * The magazine threads then send straight from memory and only go back
+ * to the file when it has changed.
+ */
+
+/** System tokens that a row can show. They are found when the page is compiled
+ * so that sending a row never has to search it.
+ */
+#define TOKEN_TEMP			0	/// %%%T temperature, 4 characters
+#define TOKEN_TIMEDATE		1	/// %%%%%%%%%%%%timedate, 20 characters
+#define TOKEN_OFFSETTIME	2	/// %t+hh or %t-hh local time offset by half hours, 5 characters
+#define TOKEN_NET			3	/// %%%%%%%%%%%%%%n network address, 15 characters
+#define TOKEN_VERSION		4	/// %%%V version number, 4 characters
+
+/** Where a token goes in its row
+ */
+typedef struct _ROWTOKEN_
+{
+	uint8_t type;		/// TOKEN_TEMP etc.
+	uint8_t offset;		/// Index of the first byte in the packet
+	uint8_t length;		/// Number of bytes to fill in
+	int16_t arg;		/// TOKEN_OFFSETTIME: the offset in half hours
+} ROWTOKEN;
+
+/** One pre-encoded packet of a stored page
+ */
+typedef struct _STOREDPACKET_
+{
+	uint8_t row;		/// Row number. 0 is the header
+	uint8_t dynamic;	/// Number of tokens that must be filled in on every transmission. 0 for a static row.
+	unsigned int token;	/// Index of the first of those tokens in the page's token list
+	char packet[PACKETSIZE];	/// The packet, parity and all. Only the token bytes change when it is sent.
+} STOREDPACKET;
+
+/** One subpage. A single page has exactly one of these, a carousel has one per subcode.
+ */
+typedef struct _SUBPAGE_
+{
+	unsigned int subcode;	/// SC value of this subpage
+	unsigned int control;	/// PS value of this subpage
+	unsigned int time;		/// CT value of this subpage (milliseconds)
+	unsigned int region;	/// RE value of this subpage
+	unsigned int first;		/// Index of the header packet of this subpage
+	unsigned int count;		/// Number of packets including the header
+} SUBPAGE;
+
+/** A compiled page file
+ */
+typedef struct _STOREDPAGE_
+{
+	PAGE page;				/// Page meta data. The same as ParsePage would return.
+	char *filename;			/// The tti file that this page was compiled from
+	time_t mtime;			/// Modification time of the file when it was compiled
+	off_t size;				/// Size of the file when it was compiled
+	unsigned int subpageCount;	/// Number of entries in subpage
+	SUBPAGE *subpage;		/// Subpage index
+	unsigned int packetCount;	/// Number of entries in packet
+	STOREDPACKET *packet;	/// All the packets of all the subpages
+	unsigned int tokenCount;	/// Number of entries in token
+	ROWTOKEN *token;		/// The tokens of all the dynamic rows
+	unsigned int refs;		/// Number of holders. The caller must serialise Hold and Release.
+} STOREDPAGE;
+
+/** PageStoreLoad - Compile a tti file into a new stored page
+ * The new page has one reference which belongs to the caller.
+ * \param filename : Name of the tti file
+ * \return The stored page or NULL if the file could not be read or is not a page
+ */
+STOREDPAGE *PageStoreLoad(char *filename);
+
+/** PageStoreRefresh - Recompile a stored page if its file has changed
+ * \param sp : A stored page
+ * \return 0 if the page is good to send, 1 if the file has gone or is no longer valid
+ */
+uint8_t PageStoreRefresh(STOREDPAGE *sp);
+
+/** PageStoreFree - Free a stored page and everything it holds, whatever its reference count
+ * \param sp : A stored page (NULL is allowed)
+ */
+void PageStoreFree(STOREDPAGE *sp);
+
+/** PageStoreHold - Take another reference on a stored page
+ * Used so that a page being sent stays valid if it is replaced or deleted meanwhile.
+ * \param sp : A stored page
+ */
+void PageStoreHold(STOREDPAGE *sp);
+
+/** PageStoreRelease - Drop a reference. The page is freed when the last one goes.
+ * \param sp : A stored page (NULL is allowed)
+ */
+void PageStoreRelease(STOREDPAGE *sp);
+
+#endif
@@ -0,0 +1,188 @@
+/** ***************************************************************************
+ * Name				: sampler.c
+ * Description       : VBIT System status sampler
+ * A thread that runs the slow system commands for the status tokens
+ * and publishes the results through a sequence lock, so the magazine
+ * threads never wait for a fork.
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+
+#include "sampler.h"
+
+static SAMPLE sample;	/// The latest values
+static atomic_uint sampleSeq;	/// Odd while sample is being written
+static pthread_t samplerThread;
+static pthread_mutex_t samplerLock=PTHREAD_MUTEX_INITIALIZER;	/// Only for samplerWake
+static pthread_cond_t samplerWake;	/// Signalled by samplerStop
+static uint8_t samplerRunning;
+
+/** takeSample - Run the commands and publish the results
+ */
+static void takeSample(void)
+{
+	SAMPLE s;
+	char str[100];
+	size_t n;
+	memset(&s,' ',sizeof(s));
+	#ifndef WIN32
+	if (get_temp(str))
+		memcpy(s.temp,str,strlen(str)<4 ? strlen(str) : 4);
+	else
+		memcpy(s.temp,"??.?",4);
+	get_net(str);	// Puts in a message if there is no address
+	n=strlen(str);
+	memcpy(s.net,str,n<15 ? n : 15);
+	#else
+	(void)str;
+	(void)n;
+	memcpy(s.temp,"??.?",4);
+	#endif
+	// The readers retry if the count is odd or changes while they copy
+	atomic_fetch_add_explicit(&sampleSeq,1,memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	sample=s;
+	atomic_fetch_add_explicit(&sampleSeq,1,memory_order_release);
+}
+
+void samplerGet(SAMPLE *s)
+{
+	unsigned int seq;
+	do
+	{
+		seq=atomic_load_explicit(&sampleSeq,memory_order_acquire);
+		*s=sample;
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) || seq!=atomic_load_explicit(&sampleSeq,memory_order_relaxed));
+}
+
+/** sampler - Thread that takes a sample every sampleInterval seconds
+ */
+static void *sampler(void *dummy)
+{
+	struct timespec when;
+	(void)dummy;
+	while (piRunning())
+	{
+		pthread_mutex_lock(&samplerLock);
+		condTimeout(&when,sampleInterval*1000);
+		if (piRunning())
+			pthread_cond_timedwait(&samplerWake,&samplerLock,&when);
+		pthread_mutex_unlock(&samplerLock);
+		if (piRunning())
+			takeSample();
+	}
+	return NULL;
+}
+
+void samplerInit(void)
+{
+	takeSample();	// So that the first pages have something to show
+	#ifndef WIN32
+	condInit(&samplerWake);
+	samplerRunning=!pthread_create(&samplerThread,NULL,sampler,NULL);
+	#endif
+}
+
+void samplerStop(void)
+{
+	if (!samplerRunning)
+		return;
+	pthread_mutex_lock(&samplerLock);
+	pthread_cond_signal(&samplerWake);
+	pthread_mutex_unlock(&samplerLock);
+	pthread_join(samplerThread,NULL);
+	samplerRunning=0;
+}
+
+#ifndef WIN32
+/** get_temp
+ *  Pinched from raspi-teletext demo.c
+ * @return Four character temperature in degrees C eg. "45.7"
+ */
+bool get_temp(char* str)
+{
+    FILE *fp;
+    char *pch;
+		char tmp[100];
+
+    str[0]=0;
+    fp = popen("/usr/bin/vcgencmd measure_temp 2>/dev/null", "r");
+    if (!fp)
+        return FALSE;
+    pch = fgets(tmp, 99, fp);
+    pclose(fp);
+    if (!pch)
+        return FALSE; // No vcgencmd? Then this isn't a Pi
+    pch = strtok (tmp,"=\n");
+    pch = strtok (NULL,"=\n");
+    if (!pch)
+        return FALSE;
+		strncpy(str,pch,4);
+		str[4]=0;
+		return TRUE;
+}
+#endif
+
+#ifndef WIN32
+/** get_net
+ *  Pinched from raspi-teletext demo.c
+ * @return network address, up to 15 characters
+ * Sample response
+ * 3: wlan0    inet 192.168.1.14/24 brd 192.168.1.255 scope global wlan0\       valid_lft forever preferred_lft forever
+ */
+bool get_net(char* str)
+{
+	FILE *fp;
+	char *pch;
+
+	int n;
+	char temp[100];
+	fp = popen("/sbin/ip -o -f inet addr show scope global", "r");
+	if (fp)
+	{
+		if (!fgets(temp, 99, fp))
+			temp[0]=0;
+		pclose(fp);
+	}
+	else
+		temp[0]=0;
+	pch = strtok (temp," \n/");
+	for (n=1; n<4 && pch; n++)
+	{
+			pch = strtok (NULL, " \n/");
+	}
+	// If we don't have a connection established, try not to crash
+	if (pch==NULL)
+	{
+		strcpy(str,"IP address????");
+		return FALSE;
+	}
+	strncpy(str,pch,15);
+	str[15]=0;
+	return TRUE; // @todo
+	// Can be up to 15 characters long
+	//for (i=strlen(temp2);i<15;i++)
+	//				temp2[i]=' ';
+	//temp2[15]=0;
+	//return TRUE;
+}
+#endif
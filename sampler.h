@@ -0,0 +1,69 @@
+/** ***************************************************************************
+ * Description       : VBIT System status sampler
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "thread.h"
+#include "delay.h"
+#include "settings.h"
+
+/** The status values that pages can show with %%%T and %%%%%%%%%%%%%%n.
+ * Finding them out means running a program, which is far too slow to do
+ * while a row is being sent. A sampler thread fetches them every
+ * sampleInterval seconds and the rows just copy the latest snapshot.
+ */
+typedef struct _SAMPLE_
+{
+	char temp[4];	/// Temperature in degrees C eg. "45.7"
+	char net[15];	/// IP address padded with spaces
+} SAMPLE;
+
+/** samplerInit - Take the first sample and start the sampler thread
+ */
+void samplerInit(void);
+
+/** samplerStop - Stop the sampler thread. Call piStop first.
+ */
+void samplerStop(void);
+
+/** samplerGet - Copy the latest sample. Cheap enough to call for every row.
+ * \param sample : Receives the sample
+ */
+void samplerGet(SAMPLE *sample);
+
+// System status. These are slow. Only the sampler should call them.
+#ifndef WIN32
+bool get_temp(char* str);
+bool get_net(char* str);
+#endif
+
+#endif
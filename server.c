@@ -0,0 +1,329 @@
+/** ***************************************************************************
+ * Name				: server.c
+ * Description       : VBIT Network command and subtitle server
+ * Accepts any number of clients on the command port, up to SERVERCLIENTS,
+ * and serves them all from one thread with epoll. Each connection has
+ * its own parser state and its own queue of replies.
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+
+#include "server.h"
+
+#define MAXPENDING 5    /* Maximum outstanding connection requests */
+
+static pthread_t serverThread;
+static uint8_t serverRunning;
+
+#ifndef WIN32
+
+#define SERVERLISTEN SERVERCLIENTS		// epoll tag of the listening socket
+#define SERVERWAKE (SERVERCLIENTS+1)	// epoll tag of the stop signal
+#define SERVEREVENTS 16	// Events handled per epoll_wait
+
+/** One connection
+ */
+typedef struct _SERVERCLIENT_
+{
+	int sock;					/// -1 if this slot is free
+	uint32_t events;			/// What epoll is watching for
+	TCPCLIENT parser;			/// Command parser state
+	unsigned int inLen;			/// Bytes waiting in in
+	char in[RCVBUFSIZE];		/// Commands not parsed yet because there was no room for their replies
+	unsigned int outLen;		/// Bytes waiting in out
+	char out[SERVEROUTSIZE];	/// Replies not sent yet
+} SERVERCLIENT;
+
+static SERVERCLIENT client[SERVERCLIENTS];
+static int listenSock=-1;
+static int epollFd=-1;
+static int wakeFd=-1;	/// eventfd that serverStop writes to
+
+/** serverRoom - Is there room in out for the biggest reply?
+ */
+static uint8_t serverRoom(SERVERCLIENT *c)
+{
+	return c->outLen+RESPONSESIZE<=SERVEROUTSIZE;
+}
+
+/** serverWatch - Tell epoll what a client is waiting for
+ * Replies that haven't gone need EPOLLOUT. A client is only read from
+ * while there is room for the replies and the last read has all been parsed,
+ * so one that doesn't read its replies stalls itself.
+ */
+static void serverWatch(SERVERCLIENT *c)
+{
+	struct epoll_event ev;
+	uint32_t events=0;
+	if (!c->inLen && serverRoom(c))
+		events|=EPOLLIN;
+	if (c->outLen)
+		events|=EPOLLOUT;
+	if (events==c->events)
+		return;
+	ev.events=events;
+	ev.data.u32=c-client;
+	epoll_ctl(epollFd,EPOLL_CTL_MOD,c->sock,&ev);
+	c->events=events;
+}
+
+/** serverClose - Drop a connection
+ */
+static void serverClose(SERVERCLIENT *c)
+{
+	epoll_ctl(epollFd,EPOLL_CTL_DEL,c->sock,NULL);
+	close(c->sock);
+	c->sock=-1;
+}
+
+/** serverFlush - Send as many of the waiting replies as the socket will take
+ * \return 0 OK, 1 if the connection has gone
+ */
+static uint8_t serverFlush(SERVERCLIENT *c)
+{
+	ssize_t n;
+	while (c->outLen)
+	{
+		n=send(c->sock,c->out,c->outLen,MSG_NOSIGNAL);
+		if (n<0)
+		{
+			if (errno==EAGAIN || errno==EWOULDBLOCK)
+				break;	// The rest goes when epoll says there is room
+			if (errno==EINTR)
+				continue;
+			return 1;
+		}
+		c->outLen-=n;
+		memmove(c->out,c->out+n,c->outLen);
+	}
+	return 0;
+}
+
+/** serverServe - Parse the commands waiting in in and send back the replies
+ * Commands whose replies won't fit wait in in until the ones before them have gone.
+ */
+static void serverServe(SERVERCLIENT *c)
+{
+	int taken;
+	do
+	{
+		if (c->inLen)
+		{
+			c->outLen+=clientReceive(&c->parser,c->in,c->inLen,c->out+c->outLen,SERVEROUTSIZE-c->outLen,&taken);
+			c->inLen-=taken;
+			memmove(c->in,c->in+taken,c->inLen);
+		}
+		if (serverFlush(c))
+		{
+			serverClose(c);
+			return;
+		}
+	} while (c->inLen && serverRoom(c));	// The socket took enough to make room for more
+	serverWatch(c);
+}
+
+/** serverRead - Take one buffer of commands from a client and send back the replies
+ * Only one buffer per wakeup, so that a busy client can't starve the others.
+ */
+static void serverRead(SERVERCLIENT *c)
+{
+	ssize_t n;
+	if (c->inLen)
+		return;	// Still working through the last one
+	n=recv(c->sock,c->in,sizeof(c->in),0);
+	if (n<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR))
+		return;
+	if (n<=0)
+	{
+		serverClose(c);	// Gone, or broken
+		return;
+	}
+	c->inLen=n;
+	serverServe(c);
+}
+
+/** serverAccept - Take all the waiting connections
+ */
+static void serverAccept(void)
+{
+	struct epoll_event ev;
+	int sock;
+	int on=1;
+	int i;
+	while ((sock=accept(listenSock,NULL,NULL))>=0)
+	{
+		fcntl(sock,F_SETFL,fcntl(sock,F_GETFL)|O_NONBLOCK);
+		fcntl(sock,F_SETFD,FD_CLOEXEC);
+		setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));	// An ACK mustn't wait for the one before it to be acknowledged
+		for (i=0;i<SERVERCLIENTS && client[i].sock>=0;i++);
+		if (i>=SERVERCLIENTS)
+		{
+			fprintf(stderr,"[serverAccept] Too many clients. Turning one away.\n");
+			close(sock);
+			continue;
+		}
+		ev.events=EPOLLIN;
+		ev.data.u32=i;
+		if (epoll_ctl(epollFd,EPOLL_CTL_ADD,sock,&ev))
+		{
+			close(sock);
+			continue;
+		}
+		client[i].sock=sock;
+		client[i].events=EPOLLIN;
+		client[i].inLen=0;
+		client[i].outLen=0;
+		clientInit(&client[i].parser);
+	}
+}
+
+/** server - Thread that serves all the clients
+ */
+static void *server(void *dummy)
+{
+	struct epoll_event ev[SERVEREVENTS];
+	SERVERCLIENT *c;
+	int n;
+	int i;
+	(void)dummy;
+	while (piRunning())
+	{
+		n=epoll_wait(epollFd,ev,SERVEREVENTS,-1);
+		for (i=0;i<n;i++)
+		{
+			if (ev[i].data.u32==SERVERWAKE)
+				return NULL;
+			if (ev[i].data.u32==SERVERLISTEN)
+			{
+				serverAccept();
+				continue;
+			}
+			c=&client[ev[i].data.u32];
+			if (c->sock<0)
+				continue;	// Closed by an earlier event in this batch
+			if (ev[i].events & EPOLLOUT)
+			{
+				serverServe(c);	// Sends what is waiting, then parses anything left over
+				if (c->sock<0)
+					continue;
+			}
+			if (ev[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))
+				serverRead(c);	// A hang up or error shows up as the read failing
+		}
+	}
+	return NULL;
+}
+
+uint8_t serverInit(void)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	int on=1;
+	int i;
+	if (!serverPort)
+		return 0;	// No network port wanted
+	for (i=0;i<SERVERCLIENTS;i++)
+		client[i].sock=-1;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_ANY);
+	addr.sin_port=htons(serverPort);
+	listenSock=socket(PF_INET,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,IPPROTO_TCP);
+	if (listenSock<0)
+		return 1;
+	setsockopt(listenSock,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));	// So a restart doesn't have to wait for old connections to time out
+	if (bind(listenSock,(struct sockaddr *)&addr,sizeof(addr)) || listen(listenSock,MAXPENDING))
+		return 1;
+	epollFd=epoll_create1(EPOLL_CLOEXEC);
+	wakeFd=eventfd(0,EFD_CLOEXEC);
+	if (epollFd<0 || wakeFd<0)
+		return 1;
+	ev.events=EPOLLIN;
+	ev.data.u32=SERVERLISTEN;
+	epoll_ctl(epollFd,EPOLL_CTL_ADD,listenSock,&ev);
+	ev.data.u32=SERVERWAKE;
+	epoll_ctl(epollFd,EPOLL_CTL_ADD,wakeFd,&ev);
+	serverRunning=!pthread_create(&serverThread,NULL,server,NULL);
+	return !serverRunning;
+}
+
+void serverStop(void)
+{
+	uint64_t one=1;
+	int i;
+	if (!serverRunning)
+		return;
+	if (write(wakeFd,&one,sizeof(one))<0)
+		perror("[serverStop] wake");
+	pthread_join(serverThread,NULL);
+	serverRunning=0;
+	for (i=0;i<SERVERCLIENTS;i++)
+		if (client[i].sock>=0)
+			serverClose(&client[i]);
+	close(listenSock);
+	close(epollFd);
+	close(wakeFd);
+}
+
+#else
+
+/** server - No epoll on Windows, so clients are served one at a time
+ */
+static void *server(void *dummy)
+{
+	SOCKET sock=(SOCKET)dummy;
+	SOCKET clientSock;
+	while (piRunning())
+	{
+		if ((clientSock=accept(sock,NULL,NULL))==INVALID_SOCKET)
+			break;
+		HandleTCPClient(clientSock);
+	}
+	return NULL;
+}
+
+uint8_t serverInit(void)
+{
+	WSADATA wsaData;
+	struct sockaddr_in addr;
+	SOCKET sock;
+	if (!serverPort)
+		return 0;
+	if (WSAStartup(MAKEWORD(2,2),&wsaData))
+		return 1;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_ANY);
+	addr.sin_port=htons(serverPort);
+	if ((sock=socket(PF_INET,SOCK_STREAM,IPPROTO_TCP))==INVALID_SOCKET)
+		return 1;
+	if (bind(sock,(struct sockaddr *)&addr,sizeof(addr)) || listen(sock,MAXPENDING))
+		return 1;
+	serverRunning=!pthread_create(&serverThread,NULL,server,(void*)sock);
+	return !serverRunning;
+}
+
+void serverStop(void)
+{
+	// The thread is left in accept(). It goes when the process does.
+}
+
+#endif
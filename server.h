@@ -0,0 +1,69 @@
+/** ***************************************************************************
+ * Description       : VBIT Network command and subtitle server
+ * Compiler          : GCC
+ *
+ * Copyright (C) 2013-2015, Peter Kwan
+ *
+ * Permission to use, copy, modify, and distribute this software
+ * and its documentation for any purpose and without fee is hereby
+ * granted, provided that the above copyright notice appear in all
+ * copies and that both that the copyright notice and this
+ * permission notice and warranty disclaimer appear in supporting
+ * documentation, and that the name of the author not be used in
+ * advertising or publicity pertaining to distribution of the
+ * software without specific, written prior permission.
+ *
+ * The author disclaims all warranties with regard to this
+ * software, including all implied warranties of merchantability
+ * and fitness.  In no event shall the author be liable for any
+ * special, indirect or consequential damages or any damages
+ * whatsoever resulting from loss of use, data or profits, whether
+ * in an action of contract, negligence or other tortious action,
+ * arising out of or in connection with the use or performance of
+ * this software.
+ *************************************************************************** **/
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "thread.h"
+#include "settings.h"
+#include "HandleTCPClient.h"
+
+/** The server takes commands and Newfor subtitles on serverPort.
+ * One thread serves every client with epoll. The sockets don't block, so a
+ * client that stops reading its replies only holds itself up, not the
+ * subtitles coming in on another connection.
+ * The replies to each batch of commands go back in one send.
+ */
+#define SERVERCLIENTS 16	// Most clients at once. Any more are turned away.
+#define SERVEROUTSIZE (2*RESPONSESIZE)	// Replies waiting to be sent to a client
+
+/** serverInit - Listen on serverPort and start the server thread
+ * Does nothing if serverPort is 0.
+ * \return 0 OK, 1 if the port could not be opened
+ */
+uint8_t serverInit(void);
+
+/** serverStop - Stop the server thread and close every connection. Call piStop first.
+ */
+void serverStop(void);
+
+#endif
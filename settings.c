@@ -11,11 +11,85 @@ uint16_t initialSubcode;
 uint16_t NetworkIdentificationCode;
 char serviceStatusString[21];
 
+// seconds between samples of the system status
+unsigned int sampleInterval;
+
+// field clock for outputstream.c
+uint8_t pacing;
+
+// network port for commands and subtitles
+unsigned int serverPort;
+
+// VBI lines for stream.c and outputstream.c
+uint8_t fieldLineCount[2];
+uint32_t fieldLineMap[2];
+
+// metrics file
+char metricsFile[MAXCONFLINE];
+unsigned int metricsInterval;
+
+// magazine scheduling for stream.c
+uint8_t magazineWeight[8];
+uint8_t magazineMinimumLines[8];
+
+/** parseMagazineList - Read eight comma separated numbers, one for each magazine 1..8
+ * \param value : The text after the = sign
+ * \param list : Receives the numbers. Only changed if they are all good.
+ * \return 0 OK, 1 if there aren't eight numbers in the range
+ */
+static uint8_t parseMagazineList(char *value, uint8_t *list, long min, long max){
+	uint8_t result[8];
+	char *end;
+	long n;
+	int i;
+	for (i=0; i<8; i++){
+		n = strtol(value, &end, 10);
+		if (end == value || n < min || n > max)
+			return 1;
+		if (*end != (i<7 ? ',' : 0))
+			return 1;
+		result[i] = n;
+		value = end+1;
+	}
+	memcpy(list,result,8);
+	return 0;
+}
+
+/** parseLineList - Read the lines of one field, eg. 1-8,10,12-16
+ * \param value : The list. It ends at a / or the end of the string.
+ * \param map : Receives the lines, bit 0 for line 1
+ * \return Where the list ended, or NULL if it is bad
+ */
+static char *parseLineList(char *value, uint32_t *map){
+	char *end;
+	long first;
+	long last;
+	*map = 0;
+	for (;;){
+		first = strtol(value, &end, 10);
+		if (end == value || first < 1 || first > MAXFIELDLINES)
+			return NULL;
+		last = first;
+		if (*end == '-'){
+			value = end+1;
+			last = strtol(value, &end, 10);
+			if (end == value || last < first || last > MAXFIELDLINES)
+				return NULL;
+		}
+		for (; first <= last; first++)
+			*map |= 1UL << (first-1);
+		if (*end != ',')
+			return end;
+		value = end+1;
+	}
+}
+
 void initConfigDefaults(void){
 	/* keep initialisation of defaults all in one place */
 	
 	// This is where the default header template is defined.
 	sprintf(headerTemplate," VBIT-PI %%%%# %%%%a %%d %%%%b%c%%H:%%M/%%S",0x83); // include alpha yellow code
+	headerCompile(headerTemplate);
 	
 	// 0 indicates teletext is multiplexed with video, 1 means full frame teletext.
 	multiplexedSignalFlag = 0;
@@ -28,6 +102,29 @@ void initConfigDefaults(void){
 	// here we set the default NI code. 0000 is rather a long string of zero bits, but that's what the spect tells us to do.
 	NetworkIdentificationCode = 0x0000; // "Where a broadcaster has not been allocated an official NI value, bytes 13 and 14 of packet 8/30 format 1 should be coded with all bits set to 0"
 	strncpy(serviceStatusString, "VBIT default", 20); // default service string.
+	
+	// temperature and network address are looked up this often. It means running a program each time.
+	sampleInterval = 10;
+	
+	// send fields as fast as the output will take them
+	pacing = PACING_OFF;
+	
+	// the port that vbit has always used for Newfor
+	serverPort = 5570;
+	
+	// the 7120/7121 DENC does 16 lines on both fields, and they all carry teletext
+	fieldLineCount[0] = fieldLineCount[1] = 16;
+	fieldLineMap[0] = fieldLineMap[1] = 0xFFFFFFFF;
+	
+	// no metrics file unless asked for
+	metricsFile[0] = 0;
+	metricsInterval = 10;
+	
+	// bigger weights get more lines. These match the old fixed priorities of 3,3,3,3,2,5,6,5
+	// mag               1  2  3  4  5  6  7  8
+	uint8_t weights[8]={10,10,10,10,15, 6, 5, 6};
+	memcpy(magazineWeight, weights, 8);
+	memset(magazineMinimumLines, 0, 8);	// no magazine is guaranteed any lines
 }
 
 int readConfigFile(char *filename){
@@ -70,11 +167,102 @@ int parseConfigLine(char *configLine){
 		// found a header template, try to copy 32 bytes into the bufferMove's template
 		if (strlen(configLine+16) == 32){ // see how long the value is - it should be exactly 32 bytes
 			strncpy(headerTemplate,configLine+16,32);
+			headerCompile(headerTemplate);	// Work out where the page and clock go once, not on every header
 			return 0;
 		} else {
 			strcpy(configErrorString,"\"header_template\" must be exactly 32 bytes");
 			return BADCONFIG; // refuse to deal with malformed header templates
 		}
+	} else if (!strncmp(configLine, "sample_interval=", 16)){
+		// how often to refresh the system status tokens, in seconds
+		char *end;
+		long seconds = strtol(configLine+16, &end, 10);
+		if (end == configLine+16 || *end || seconds < 1 || seconds > 3600){
+			strcpy(configErrorString,"\"sample_interval\" must be a number of seconds from 1 to 3600");
+			return BADCONFIG;
+		}
+		sampleInterval = seconds;
+		return 0;
+	} else if (!strncmp(configLine, "server_port=", 12)){
+		// TCP port for commands and Newfor subtitles. 0 for none.
+		char *end;
+		long port = strtol(configLine+12, &end, 10);
+		if (end == configLine+12 || *end || port < 0 || port > 65535){
+			strcpy(configErrorString,"\"server_port\" must be a port number from 0 to 65535");
+			return BADCONFIG;
+		}
+		serverPort = port;
+		return 0;
+	} else if (!strncmp(configLine, "field_rate=", 11)){
+		// pace the output with a field clock
+		if (!strcmp(configLine+11, "off"))
+			pacing = PACING_OFF;
+		else if (!strcmp(configLine+11, "50"))
+			pacing = PACING_50HZ;
+		else if (!strcmp(configLine+11, "59.94"))
+			pacing = PACING_5994HZ;
+		else {
+			strcpy(configErrorString,"\"field_rate\" must be off, 50 or 59.94");
+			return BADCONFIG;
+		}
+		return 0;
+	} else if (!strncmp(configLine, "field_lines=", 12)){
+		// VBI lines per field. One number for both fields, or odd,even
+		char *end;
+		long odd = strtol(configLine+12, &end, 10);
+		long even = odd;
+		if (*end == ',')
+			even = strtol(end+1, &end, 10);
+		if (end == configLine+12 || *end || odd < 1 || odd > MAXFIELDLINES || even < 1 || even > MAXFIELDLINES){
+			sprintf(configErrorString,"\"field_lines\" must be one or two numbers from 1 to %d",MAXFIELDLINES);
+			return BADCONFIG;
+		}
+		fieldLineCount[0] = odd;
+		fieldLineCount[1] = even;
+		return 0;
+	} else if (!strncmp(configLine, "line_map=", 9)){
+		// lines that carry teletext. One list for both fields, or odd/even
+		uint32_t map[2];
+		char *end = parseLineList(configLine+9, &map[0]);
+		map[1] = map[0];
+		if (end && *end == '/')
+			end = parseLineList(end+1, &map[1]);
+		if (!end || *end){
+			sprintf(configErrorString,"\"line_map\" must be lists of lines from 1 to %d, eg. 1-16/2-16",MAXFIELDLINES);
+			return BADCONFIG;
+		}
+		fieldLineMap[0] = map[0];
+		fieldLineMap[1] = map[1];
+		return 0;
+	} else if (!strncmp(configLine, "metrics_file=", 13)){
+		// where to write the metrics
+		strncpy(metricsFile, configLine+13, MAXCONFLINE-1);
+		metricsFile[MAXCONFLINE-1] = 0;
+		return 0;
+	} else if (!strncmp(configLine, "metrics_interval=", 17)){
+		// how often to write them, in seconds
+		char *end;
+		long seconds = strtol(configLine+17, &end, 10);
+		if (end == configLine+17 || *end || seconds < 1 || seconds > 3600){
+			strcpy(configErrorString,"\"metrics_interval\" must be a number of seconds from 1 to 3600");
+			return BADCONFIG;
+		}
+		metricsInterval = seconds;
+		return 0;
+	} else if (!strncmp(configLine, "magazine_weights=", 17)){
+		// eight weights, magazines 1 to 8
+		if (parseMagazineList(configLine+17, magazineWeight, 1, 100)){
+			strcpy(configErrorString,"\"magazine_weights\" must be eight numbers from 1 to 100");
+			return BADCONFIG;
+		}
+		return 0;
+	} else if (!strncmp(configLine, "magazine_minimum_lines=", 23)){
+		// eight line counts, magazines 1 to 8
+		if (parseMagazineList(configLine+23, magazineMinimumLines, 0, MAXFIELDLINES)){
+			sprintf(configErrorString,"\"magazine_minimum_lines\" must be eight numbers from 0 to %d",MAXFIELDLINES);
+			return BADCONFIG;
+		}
+		return 0;
 	} else if (!strncmp(configLine, "initial_teletext_page=", 22)){
 		// found an initial page, it must be at least three bytes.
 		if (strlen(configLine+22) < 3){
@@ -7,6 +7,8 @@
 #include <ctype.h>
 #include <stdint.h>
 
+#include "header.h"
+
 #define CONFIGFILE "vbit.conf" // default config file name
 #define NOCONFIG 1 // failed to open config file
 #define BADCONFIG 2 // config file malformed
@@ -25,6 +27,33 @@ extern uint16_t initialSubcode;
 extern uint16_t NetworkIdentificationCode;
 extern char serviceStatusString[21];
 
+// seconds between samples of the system status (temperature, network address)
+extern unsigned int sampleInterval;
+
+// TCP port for commands and Newfor subtitles. 0 turns the server off.
+extern unsigned int serverPort;
+
+// real time output. Off means as fast as the consumer of stdout will take it.
+#define PACING_OFF 0
+#define PACING_50HZ 1 // 50 fields a second, 625 line
+#define PACING_5994HZ 2 // 60000/1001 fields a second, 525 line
+extern uint8_t pacing;
+
+// VBI lines that the output sends in each field, odd field first. The program reading stdout must expect the same.
+#define MAXFIELDLINES 32
+extern uint8_t fieldLineCount[2];
+// which of those lines carry teletext. Bit 0 is the first line of the field. The others are sent blank.
+extern uint32_t fieldLineMap[2];
+
+// write the pipeline metrics to this file every metricsInterval seconds. Empty for none.
+extern char metricsFile[MAXCONFLINE];
+extern unsigned int metricsInterval;
+
+// share of the VBI lines that each magazine gets. Index 0 is magazine 1.
+extern uint8_t magazineWeight[8];
+// VBI lines in every field that a magazine gets first, if it has something to send
+extern uint8_t magazineMinimumLines[8];
+
 // description of last error encountered reading config file
 extern char configErrorString[100];
 
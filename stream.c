@@ -6,6 +6,8 @@
  * Packets are sequenced by mag priority, primary and secondary actions.
  * They also interact with the mag state engines to ensure that headers
  * and their rows don't appear on the same field.
+ * Subtitles come first. A subtitle header goes out as soon as it arrives
+ * and its rows go at the top of the next field.
  * Sources packets from mag.c
  * Sinks packets to FillFIFO.c 
  * Copyright (c) 2013-2015 Peter Kwan. All rights reserved.
@@ -14,73 +16,210 @@
 
 // #define _DEBUG_
 
-// The stream buffer is 20 packets STREAMBUFFERSIZE
+// The stream buffer is 32 packets STREAMBUFFERSIZE
 
-// This should be 9. We want to add the subtitle streams
+// Eight magazines and the subtitle lane
 #define STREAMS 9
+#define SUBTITLES 8	// The stream number of the subtitle lane
 
 bufferpacket streamBuffer[1];//  
-uint8_t streamPacket[STREAMBUFFERSIZE*PACKETSIZE*2]; // The 2 is extra storage to find out what is making it crash
-// The lower the priority number, the faster the magazine runs.
-// This way you can choose which mags are more important.
-//                   mag 8 1 2 3 4 5 6 7
-static char priority[STREAMS]={5,3,3,3,3,2,5,6,1};	// 1=High priority,9=low. Note: priority[0] is mag 8, while priority mag[8] is the newfor stream!
-static char priorityCount[STREAMS];
+bufferslot streamPacket[STREAMBUFFERSIZE];
+// Magazine scheduling. Stream 0 is mag 8, streams 1..7 are mags 1..7.
+// Stream 8 is the newfor subtitles, which have strict priority and don't take part in the sharing.
+#define MAGAZINES 8
+static uint8_t weight[STREAMS];	/// Lines that a magazine gets each time round
+static uint8_t minimum[STREAMS];	/// Lines that a magazine gets first in every field
+static int deficit[STREAMS];	/// Lines that a magazine has left to send this time round
+uint8_t streamLines[2];
+
+/** mapLines - Count the lines of a field that carry teletext
+ * Lines past the end of the field are taken out of the map.
+ * A field with none left gets all of its lines, rather than no teletext at all.
+ * \param f : 0 for the odd field, 1 for the even
+ */
+static uint8_t mapLines(uint8_t f)
+{
+	uint8_t i;
+	uint8_t n=0;
+	if (fieldLineCount[f]<32)
+		fieldLineMap[f]&=(1UL<<fieldLineCount[f])-1;
+	if (!fieldLineMap[f])
+	{
+		fprintf(stderr,"[streamInit] No teletext lines in the %s field. Using all %d.\n",f ? "even" : "odd",fieldLineCount[f]);
+		fieldLineMap[f]=fieldLineCount[f]<32 ? (1UL<<fieldLineCount[f])-1 : 0xFFFFFFFF;
+	}
+	for (i=0;i<fieldLineCount[f];i++)
+		n+=fieldLineMap[f]>>i & 1;
+	return n;
+}
+
+/** streamInit - Set up the stream buffer and the magazine shares
+ * Call after the config is read and before the Stream and OutputStream threads start, as they both use it.
+ */
+void streamInit(void)
+{
+	uint8_t i;
+	unsigned int total=0;
+	bufferInit(streamBuffer,streamPacket,STREAMBUFFERSIZE);
+	streamLines[0]=mapLines(0);
+	streamLines[1]=mapLines(1);
+	for (i=0;i<MAGAZINES;i++)
+	{
+		weight[i]=magazineWeight[(i+7)%8];	// The settings start at mag 1
+		minimum[i]=magazineMinimumLines[(i+7)%8];
+		total+=minimum[i];
+	}
+	if (total>streamLines[0] || total>streamLines[1])
+	{
+		fprintf(stderr,"[streamInit] The magazine minimum lines add up to more than a field. Ignoring them.\n");
+		memset(minimum,0,sizeof(minimum));
+	}
+}
+
+/** nextStream - Decide which magazine gets the next line
+ * Magazines that haven't had their minimum lines in this field go first.
+ * The rest is shared by deficit round robin. Each magazine in turn gets its weight
+ * in lines to spend. A magazine that runs dry loses what it had left, so the
+ * lines it doesn't use go to the others.
+ * \param hold : Magazines that must wait for the next field
+ * \param fieldLines : Lines each magazine has sent in this field
+ * \return The stream to send from, or -1 if they are all on hold
+ */
+static int nextStream(uint8_t *hold, uint8_t *fieldLines)
+{
+	static int current=0;	// The magazine whose turn it is
+	int i;
+	int mag;
+	for (i=1;i<=MAGAZINES;i++)
+	{
+		mag=(current+i)%MAGAZINES;
+		if (!hold[mag] && fieldLines[mag]<minimum[mag])
+			return mag;
+	}
+	// Once round is enough for every magazine that isn't on hold to get a turn
+	for (i=0;i<=MAGAZINES;i++)
+	{
+		if (!hold[current] && deficit[current]>0)
+			return current;
+		current=(current+1)%MAGAZINES;
+		if (!hold[current])
+			deficit[current]+=weight[current];
+	}
+	return -1;
+}
+
+/** skipInterrupted - Skip what is left of a magazine page that a subtitle cut into
+ * In parallel mode a row belongs to the last header of its magazine. Once a
+ * subtitle header has gone out, the rest of the page that the magazine was in
+ * the middle of would land on the subtitle page. That page goes again next cycle.
+ * \param bp : The magazine's buffer
+ * \return 1 when the magazine is at a header, 0 if it ran dry first
+ */
+static uint8_t skipInterrupted(bufferpacket *bp)
+{
+	packetmeta meta;
+	char packet[PACKETSIZE];
+	while (bufferPeekMeta(bp,&meta)==BUFFER_OK)
+	{
+		if (meta.flags & PACKETMETA_HEADER)
+			return 1;
+		bufferGet(bp,packet);
+		metricsAdd(metrics.subtitleSkips,1);
+	}
+	return 0;
+}
+
+void streamReport(FILE *f)
+{
+	unsigned long lines[MAGAZINES];
+	unsigned long subtitles=metricsGet(metrics.subtitleLines);
+	unsigned long service=metricsGet(metrics.serviceLines);
+	unsigned long quiet=metricsGet(metrics.quietLines);
+	unsigned long total=subtitles+service+quiet;
+	uint8_t i;
+	for (i=0;i<MAGAZINES;i++)
+		total+=lines[i]=metricsGet(metrics.magLines[i]);
+	if (!total)
+		total=1;
+	for (i=1;i<=MAGAZINES;i++)
+		fprintf(f,"[streamReport] mag %d %5.1f%% of lines (weight %d, minimum %d)\n",
+			i,100.0*lines[i%8]/total,weight[i%8],minimum[i%8]);
+	fprintf(f,"[streamReport] subtitles %5.1f%%, 8/30 %5.1f%%, quiet %5.1f%% of %lu lines\n",
+		100.0*subtitles/total,100.0*service/total,100.0*quiet/total,total);
+	fprintf(f,"[streamReport] %lu subtitles, %lu dropped, worst OnAir to output %lu us\n",
+		metricsGet(metrics.subtitles),metricsGet(metrics.subtitleDrops),
+		metricsGet(metrics.source[LATENCY_SUBTITLE][LATENCY_TOTAL].max));
+}
+
+/** streamMeta - Describe a packet that stream.c made itself
+ */
+static void streamMeta(packetmeta *meta, uint8_t mag, uint8_t row, uint8_t flags)
+{
+	meta->created=micros();
+	meta->moved=meta->created;	// It goes straight onto the stream buffer
+	meta->mag=mag;
+	meta->row=row;
+	meta->page=0;
+	meta->flags=flags;
+}
 
 PI_THREAD (Stream)
 {
 	int mag=0;
-	uint8_t line=16; // start at 16, will get rolled over to 0 immediately
+	uint8_t line=0;
+	uint8_t lines=0;	/// Teletext lines in this field. None to start with, so the first field starts straight away.
 	uint8_t i;
 	uint8_t result;
-	uint8_t holdCount=0;	/// If the entire service is on hold, we need to add lines, either filler or quiet
+	uint8_t start;	/// PACKETMETA_FIELDSTART for the first line of a field, so that OutputStream can find it
+	uint8_t even=0;	/// Set while the field is even. OutputStream lays it out with that line map.
 	uint8_t field=0;	/// Count fields
+	uint8_t fieldsPerSecond=pacing==PACING_5994HZ ? 60 : 50;	/// So that 8/30 format 1 goes once a second
 	uint8_t hold[STREAMS];	/// If hold is set then we must wait for the next field to reset them
-	uint32_t skip=0;	// How many lines we were unable to put real packets on
+	uint8_t fieldLines[STREAMS];	/// Lines each stream has sent in this field
+	uint8_t guaranteed;	/// Set if this line is part of a minimum, which doesn't count against the weight
+	uint8_t interrupted[MAGAZINES];	/// Set if a subtitle cut into the page that the magazine was sending
+	packetmeta lane;	// The last packet sent from the subtitle lane
+	time_t second=0;	// The second that headersPerSecond is being counted for
+	unsigned long secondHeaders=0;	// metrics.headers at the start of that second
 	uint8_t packet[PACKETSIZE];	
+	packetmeta meta;	// Describes the packets that we make ourselves
 	for (i=0;i<STREAMS;i++)
 	{
 		hold[i]=0;
-		priorityCount[i]=priority[i];
+		fieldLines[i]=0;
 	}
-	// Initialise the stream buffer
-	bufferInit(streamBuffer,(char*)streamPacket,STREAMBUFFERSIZE);
-	delay(500);	// Give the other threads a chance to get started
-	// Poll the input buffers and hold back until there is data ready to go 
-	for (mag=0;!bufferIsEmpty(&magBuffer[mag]);mag=(mag+1)%8) delay(10);
-	while(1)
+	memset(interrupted,0,sizeof(interrupted));
+	// The pages are all loaded before the mag threads start, so there is no need to hold back.
+	// Any gaps while the mags get going are filled with quiet packets.
+	while (piRunning())
 	{
-		// printf("Hello from stream\n");
-		// delayMicroseconds(100);
-		
-		// make it go next. It could pretend to be magazine 9. 
-		// You must not put any pages on that magazine or they may be corrupted.
+		// Sleep until OutputStream makes some room. Nothing can go out until then.
+		bufferWaitSpace(streamBuffer,1000);
 
-		// If there is ANYTHING in the subtitle buffer it goes immediately, as long as we are not waiting for the next field
-		if (!bufferIsEmpty(&magBuffer[8]) && !hold[8] && FALSE) // subtitle buffer is smashing the stack
-		{
-			mag=8;
-			priorityCount[0]=32; // Also delay mag 8 for two fields so it doesn't clash
-		}
-		else
-		// Decide which mag can go next
-		for (;priorityCount[mag]>0;mag=(mag+1)%STREAMS)
-		{
-			priorityCount[mag]--;
-		}
-		// This scheme more or less works but there is no guarantee that it stays in sync.
-		// So we need to ensure that FillFIFO knows what this phase is and matches it to the output.
-		// The 7120/7121 DENC only does up to 16 lines on both fields. Line 17 is not available for us :-(
 		// The lines and fields should stay synchronised so long as nothing increments a line without 
-		// actually pushing a packet onto the buffer.
-		// (carousel pages breaking in over normal pages)
-		if (line>=16)
+		// actually pushing a packet onto the buffer. The first line of each field is marked, so that
+		// if OutputStream ever has to pad a field it can find the start of the next one.
+		// The number of lines comes from the line map. The odd and even fields can differ.
+		if (line>=lines)
 		{
 			line=0;
-			for (i=0;i<STREAMS;i++) hold[i]=0;	// Any holds are released now
+			even=field&1;	// An even number of fields a second, so field 0 is always odd
+			lines=streamLines[even];
+			for (i=0;i<STREAMS;i++)	// Any holds are released now
+			{
+				hold[i]=0;
+				fieldLines[i]=0;
+			}
+			clockTick();	// Everything in this field shows the same time
+			if (clockNow()!=second)
+			{
+				second=clockNow();
+				metricsSet(metrics.headersPerSecond,metricsGet(metrics.headers)-secondHeaders);
+				secondHeaders=metricsGet(metrics.headers);
+			}
 			
 			// may as well insert packet 8/30 on first line of vbi
-			if(field>=50) field = 0; // loop field counter every second
+			if(field>=fieldsPerSecond) field = 0; // loop field counter every second
 			
 			switch (field)
 			{
@@ -88,8 +227,10 @@ PI_THREAD (Stream)
 					// packet 8/30 format 1
 					// this should occur during the first vbi following a clock second, but we're buffering stuff anyway so there's no point even trying to synchronise that finely
 					Packet30(packet, 1, serviceStatusString);
-					while(bufferPut(streamBuffer,(char*)packet)!=BUFFER_OK) delay(10); // force this to be added to buffer
+					streamMeta(&meta,8,30,PACKETMETA_SERVICE|PACKETMETA_FIELDSTART);
+					while(bufferPutMeta(streamBuffer,(char*)packet,&meta)!=BUFFER_OK && piRunning()) bufferWaitSpace(streamBuffer,1000); // force this to be added to buffer
 					//fprintf(stderr, "[stream] inserting 8/30 f1 in field %d line %d\n",field,line);
+					metricsAdd(metrics.serviceLines,1);
 					line++;
 					break;
 				
@@ -117,54 +258,72 @@ PI_THREAD (Stream)
 			field++;
 		}
 
-		if (!hold[mag])
+		// If there is ANYTHING in the subtitle lane it goes immediately, as long as we are not waiting for the next field.
+		// A subtitle goes on the lane whole, so its rows are there as soon as its header is.
+		start=line ? 0 : PACKETMETA_FIELDSTART|(even ? PACKETMETA_EVEN : 0);
+		if (!hold[SUBTITLES] && subtitleReady())
+			mag=SUBTITLES;
+		else
+			mag=nextStream(hold,fieldLines);
+		
+		if (mag>=0)
 		{
-			holdCount=0;
+			guaranteed=mag==SUBTITLES || fieldLines[mag]<minimum[mag];	// Subtitles don't count against anyone's share
 			// Pop a packet from a mag and push it to the stream		
-			// dumpPacket(magBuffer[mag].pkt);
-			result=bufferMove(streamBuffer,&(magBuffer[mag]));
+			if (mag==SUBTITLES)
+				result=subtitleMove(streamBuffer,&lane,start);
+			else if (interrupted[mag] && !skipInterrupted(&magBuffer[mag]))
+				result=BUFFER_EMPTY;	// Still skipping the rest of the page
+			else
+			{
+				interrupted[mag]=0;
+				result=bufferMove(streamBuffer,&magBuffer[mag],start);
+			}
 
 			switch (result)
 			{
 			case BUFFER_FULL: 	// Buffer full. This is good because it means that we are not holding things up
-			
-				//delay(1);	// Hold so we can see the message (WiringPi)
 				break;
 			case BUFFER_EMPTY: 	// Source not ready. We expect mag to send us something very soon
 				// If a stream has no pages, this branch will get called a lot
-				
 				hold[mag]=1;	// Might as well put it in hold. If this isn't here then the mag can grab ALL the packets
-				// delay(1);	// Hold so we can see the error
+				deficit[mag]=0;	// and the lines it didn't use go to the others
+				metricsAdd(metrics.emptyHolds,1);
 				break;
 			case BUFFER_HEADER:		// Header row
-				// fprintf(stderr,"%01d",mag);
-				hold[mag]=1;
+				hold[mag]=1;	// The rows of the page must not go out in the same field
+				if (mag==SUBTITLES)
+				{
+					// Nor may anything from the subtitle's magazine until the rows have gone at the top of the next field
+					hold[lane.mag%8]=1;
+					interrupted[lane.mag%8]=1;
+				}
+				metricsAdd(metrics.headers,1);
+				metricsAdd(metrics.headerHolds,1);
 				// Intentional fall through
 			case BUFFER_OK:  // Normal row
 				line++;	// Count up the lines sent
+				fieldLines[mag]++;
+				if (!guaranteed)
+					deficit[mag]--;
+				if (mag<MAGAZINES)
+					metricsAdd(metrics.magLines[mag],1);
+				else
+					metricsAdd(metrics.subtitleLines,1);
 				break;				
 			}
-			// TODO: If ALL fields are on hold we need to output filler or quiet
-			// TODO: Implement stream side buffer
 		}
 		else
 		{	// If there really is nothing to send, send a filler or quiet
-			holdCount++;
-			if (holdCount>=8) 	// all mags are in nip?
+			// This RARELY happens except at the start
+			PacketQuiet(packet);
+			streamMeta(&meta,8,0,PACKETMETA_QUIET|start);
+			if(bufferPutMeta(streamBuffer,(char*)packet,&meta) == BUFFER_OK)
 			{
-				skip++;
-				//printf("[stream] inserting quiet %d\n",skip);	// You can remove this line. It is for debugging
-				// TODO: If this message comes up,
-				// Then add quiet or filler 8/25 packets.
-				// This RARELY happens except at the start
-				PacketQuiet(packet);
-				if(bufferPut(streamBuffer,(char*)packet) == BUFFER_OK) line++;;
+				line++;
+				metricsAdd(metrics.quietLines,1);
 			}
 		}
-		// printf("[Stream] mag=%d\n",mag); 
-		if (priority[mag]==0) priority[mag]=1;	// Can't be 0 or that mag will take all the packets
-		priorityCount[mag]=priority[mag];	// Reset the priority for the mag that just went out
-		//else
-		//	printf("[Stream] mag buffer %d is empty\n",mag);
 	}
-} 
+	return NULL;
+}
@@ -19,6 +19,8 @@
 #include "buffer.h"
 #include "mag.h"
 #include "delay.h"
+#include "metrics.h"
+#include "nu4.h"
 
 
 /** Stream is a thread that 
@@ -27,8 +29,16 @@
 3) inserts special packets 8/30, databroadcast etc.
 4) sources packets to outputstream.c
 */
+/** streamInit - Set up the stream buffer and magazine shares. Call before starting the threads. */
+void streamInit(void);
+/** streamReport - Print the share of the lines that each magazine has had so far
+ * \param f : Where to print it
+ */
+void streamReport(FILE *f);
 PI_THREAD (Stream);
-#define STREAMBUFFERSIZE 20
+#define STREAMBUFFERSIZE 32
 extern bufferpacket streamBuffer[1];
+// Number of VBI lines in the odd and even fields that carry teletext. Set by streamInit from the line map.
+extern uint8_t streamLines[2];
 
 #endif
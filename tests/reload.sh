@@ -0,0 +1,60 @@
+#!/bin/sh
+
+# reload.sh checks that SIGHUP reloads don't undo page changes
+# A set of pages is rewritten over and over while vbit is sent SIGHUP each time.
+# Once the writes stop, every page that vbit sends must be the last version.
+# usage: tests/reload.sh [vbit]    (make check runs it)
+
+VBIT=${1:-./vbit}
+PAGES=64
+DIR=$(mktemp -d) || exit 1
+trap 'kill $PID 2>/dev/null; rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/pages"
+printf 'server_port=0\nfield_rate=50\n' > "$DIR/pages/vbit.conf"
+
+# pages <version> - Write every page again
+pages()
+{
+	awk -v dir="$DIR/pages" -v pages=$PAGES -v version="$1" 'BEGIN {
+		for (n = 0; n < pages; n++) {
+			mag = n % 8 + 1
+			file = sprintf("%s/P%d%02X.tti", dir, mag, n / 8)
+			printf "PN,%d%02X00\r\nSC,0000\r\nPS,8000\r\nOL,1,Page %03d version %s\r\n", mag, n / 8, n, version > file
+			for (row = 2; row <= 23; row++)
+				printf "OL,%d,Row %d of page %03d version %s\r\n", row, row, n, version > file
+			close(file)
+		}
+	}'
+}
+
+pages 0
+"$VBIT" --dir "$DIR/pages" > "$DIR/out" 2> "$DIR/err" &
+PID=$!
+sleep 1
+
+n=1
+while [ $n -le 50 ]; do
+	kill -HUP $PID || exit 1
+	pages $n
+	n=$((n+1))
+done
+kill -HUP $PID
+pages last
+
+sleep 2	# Let the reloads finish
+SIZE=$(wc -c < "$DIR/out")
+sleep 5	# More than once round every magazine
+kill $PID
+wait $PID
+
+# Strip the parity so the text can be found. Each page must be seen, and only its last version.
+SEEN=$(tail -c +$((SIZE+1)) "$DIR/out" | tr '\200-\377' '\000-\177' | grep -ao 'Page [0-9]* version [0-9a-z]*' | sort -u)
+OLD=$(echo "$SEEN" | grep -vc 'version last$')
+LAST=$(echo "$SEEN" | grep -c 'version last$')
+if [ "$OLD" -ne 0 ] || [ "$LAST" -ne $PAGES ]; then
+	echo "reload: FAIL. $LAST of $PAGES pages have the last version. Older versions still sent:"
+	echo "$SEEN" | grep -v 'version last$'
+	exit 1
+fi
+echo "reload: pass"
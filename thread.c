@@ -23,11 +23,15 @@
  ***********************************************************************
  */
 
+#include <stdatomic.h>
+
 #include "thread.h"
 // #include "wiringPi.h"
 
 static pthread_mutex_t piMutexes [4] ;
 
+static atomic_int running = 1 ;	// Cleared when vbit is shutting down
+
 
 
 /*
@@ -43,6 +47,58 @@ int piThreadCreate (void *(*fn)(void *))
   return pthread_create (&myThread, NULL, fn, NULL) ;
 }
 
+/*
+ * piThreadStart:
+ *	Create and start a thread, keeping its handle so that it can be joined
+ *********************************************************************************
+ */
+
+int piThreadStart (pthread_t *thread, void *(*fn)(void *))
+{
+  return pthread_create (thread, NULL, fn, NULL) ;
+}
+
+/*
+ * piThreadCpu:
+ *	The CPU time that a running thread has used so far, in microseconds.
+ *	0 if the system can't tell us.
+ *********************************************************************************
+ */
+
+uint64_t piThreadCpu (pthread_t thread)
+{
+#ifndef WIN32
+  clockid_t cid ;
+  struct timespec used ;
+
+  if (pthread_getcpuclockid (thread, &cid) || clock_gettime (cid, &used))
+    return 0 ;
+  return (uint64_t)used.tv_sec * 1000000 + used.tv_nsec / 1000 ;
+#else
+  (void)thread ;
+  return 0 ;
+#endif
+}
+
+
+/*
+ * piRunning: piStop:
+ *	The threads loop while piRunning is true.
+ *	piStop asks them all to finish. It is safe to call from a signal handler.
+ *********************************************************************************
+ */
+
+int piRunning (void)
+{
+  return atomic_load (&running) ;
+}
+
+void piStop (void)
+{
+  atomic_store (&running, 0) ;
+}
+
+
 /*
  * piLock: piUnlock:
  *	Activate/Deactivate a mutex.
@@ -2,6 +2,8 @@
 #define _THREAD_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 // Threads
 
 #define	PI_THREAD(X)	void *X (void *dummy)
@@ -9,6 +11,10 @@
 // Threads
 
 extern int  piThreadCreate      (void *(*fn)(void *)) ;
+extern int  piThreadStart       (pthread_t *thread, void *(*fn)(void *)) ;
+extern uint64_t piThreadCpu     (pthread_t thread) ;
+extern int  piRunning           (void) ;
+extern void piStop              (void) ;
 extern void piLock              (int key) ;
 extern void piUnlock            (int key) ;
 extern void init_mutex(int);
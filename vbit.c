@@ -39,9 +39,6 @@ void DieWithError(char *errorMessage)
     exit(1);
 }
 
-void HandleTCPClient(int clntSocket);   /* TCP client handling function */
-#define MAXPENDING 5    /* Maximum outstanding connection requests */
-
 /* hic sunt globals */
 
 /* These are set by everyFieldInterrupt
@@ -58,92 +55,41 @@ volatile uint8_t fifoWriteIndex; /// maintains the load index 0..MAXFIFOINDEX-1
 
 
 
-/** Look for a client 
- * 	This will handle commands but doesn't do anything ATM.
- * Think this will need to go in a thread
+#ifdef WIN32
+/** stopHandler - No sigwait on Windows, so Ctrl-C just asks the threads to stop
  */
-//void runClient(void)
-PI_THREAD(runClient)
+static void stopHandler(int sig)
 {
-	// Network stuff from http://cs.baylor.edu/~donahoo/practical/CSockets/code/TCPEchoServer.c
-    int serverSock;                    /* Socket descriptor for server */
-    int clientSock;                    /* Socket descriptor for client */	
-    struct sockaddr_in echoServAddr; /* Local address */
-    struct sockaddr_in echoClntAddr; /* Client address */	
-    unsigned short echoServPort;     /* Server port */
-	#ifdef WIN32
-    int clntLen;                     /* needs to be signed int for winsock */
-	#else
-	unsigned int clntLen;            /* Length of client address data structure */
-	#endif
-
-	echoServPort = 5570;  /* This is the local port */
-
-	#ifdef WIN32
-	WSADATA wsaData;
-    int iResult;
-	
-	// Initialize Winsock
-    iResult = WSAStartup(MAKEWORD(2,2), &wsaData);
-    if (iResult != 0) {
-		DieWithError("WSAStartup failed");
-    }
-	#endif
-	
-	// System initialisations
-	/* Construct local address structure */
-    memset(&echoServAddr, 0, sizeof(echoServAddr));   /* Zero out structure */
-    echoServAddr.sin_family = AF_INET;                /* Internet address family */
-    echoServAddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
-    echoServAddr.sin_port = htons(echoServPort);      /* Local port */
-
-    /* Create socket for incoming connections */
-    if ((serverSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-        DieWithError("socket() failed\n");	
-	
-
-    /* Bind to the local address */
-    if (bind(serverSock, (struct sockaddr *) &echoServAddr, sizeof(echoServAddr)) < 0)
-        DieWithError("bind() failed");
-
-    /* Mark the socket so it will listen for incoming connections */
-    if (listen(serverSock, MAXPENDING) < 0)
-        DieWithError("listen() failed");	
-	
-
-
-	/* Set the size of the in-out parameter */
-	clntLen = sizeof(echoClntAddr);
-	
-	while(1)
-	{
-
-		/* Wait for a client to connect */
-		if ((clientSock = accept(serverSock, (struct sockaddr *) &echoClntAddr, 
-							   &clntLen)) < 0)
-			DieWithError("accept() failed");
-
-		/* clientSock is connected to a client! */
-
-		// printf("Handling client %s\n", inet_ntoa(echoClntAddr.sin_addr));
-
-		HandleTCPClient(clientSock);
-	}
-	return NULL;
-} // runClient
+	(void)sig;
+	piStop();
+}
+#endif
 
 int main (int argc, char** argv)
 {
 	
 	int i;
 	char filename[MAXPATH];
+	pthread_t streamThread;
+	pthread_t outputThread;
+	sigset_t signals;
+	#ifndef WIN32
+	int sig;
+	#endif
+	uint8_t bench=0;	// Set by --bench. Run flat out with no output and report how fast.
+	unsigned int benchSeconds=10;
 	
-	if(argc > 2){
-		if(!strcmp(argv[1],"--dir")){
+	for (i=1;i<argc;i++){
+		if(!strcmp(argv[i],"--dir") && i+1<argc){
+			i++;
 			#ifdef _DEBUG_
-			fprintf(stderr,"got directory %s from command line\n",argv[2]);
+			fprintf(stderr,"got directory %s from command line\n",argv[i]);
 			#endif
-			strncpy(pagesPath, argv[2], MAXPATH-1); /* copy directory string to global */
+			strncpy(pagesPath, argv[i], MAXPATH-1); /* copy directory string to global */
+		} else if(!strcmp(argv[i],"--bench")){
+			bench=1;
+			if (i+1<argc && atoi(argv[i+1])>0) // optionally followed by the number of seconds
+				benchSeconds=atoi(argv[++i]);
 		}
 	}
 	
@@ -174,39 +120,102 @@ int main (int argc, char** argv)
 			return 1;
 	}
 	
+	if (bench){
+		pacing=PACING_OFF;	// as fast as it will go
+		outputDiscard();	// to nowhere
+	}
+	
+	#ifndef WIN32
+	// Block the signals that we handle before any thread starts, so only the sigwait below sees them
+	sigemptyset(&signals);
+	sigaddset(&signals,SIGINT);
+	sigaddset(&signals,SIGTERM);
+	sigaddset(&signals,SIGHUP);
+	sigaddset(&signals,SIGUSR1);
+	pthread_sigmask(SIG_BLOCK,&signals,NULL);
+	#endif
+	
 	/* initialize the mutexes we're going to use! */
 	init_mutex(0);
 	init_mutex(1);
 	
 	InitNu4(); // Prepare the buffers used by Newfor subtitles
 	
-	// Start the network port (commands and subtitles)
-	i=piThreadCreate(runClient);
+	// Start the network port (commands and subtitles). Not wanted for a benchmark.
+	if (!bench && serverInit())
+	{
+		fprintf(stderr,"Can't listen on port %u: %s\n",serverPort,strerror(errno));
+		return 1;
+	}
 	//while(1);
 	
+	metricsInit();	// Start the clock for uptime and the metrics file, if there is one
+	clockInit();	// Headers, 8/30 and the row tokens all get the time from here
+	samplerInit();	// Temperature and network address. Before the magazines so the first pages have them.
+
 	// Set up the eight magazine threads
 	magInit();
 
+	streamInit();	// The stream buffer must be ready before either stream thread uses it
+
 	// TODO: Test that the threads started.
 	
 	// Sequence streams of packets into VBI fields
-	i=piThreadCreate(Stream);
+	i=piThreadStart(&streamThread,Stream);
 	if (i != 0)
 	{
 		// printf ("Stream thread! It didn't start\n");		
 		return 1;
 	}
 	// Copy VBI to stdout
-	i=piThreadCreate(OutputStream);
+	i=piThreadStart(&outputThread,OutputStream);
 	if (i != 0)
 	{
 		// printf ("OutputStream thread! It didn't start\n");
 		return 1;
 	}
-	while (1)
+
+	if (bench)
 	{
+		benchRun(benchSeconds,&signals,streamThread,outputThread);
+		piStop();
 	}
-	fputs("Finished\n",stderr); // impossible to get here
-	return 1;
-}
 
+	// The threads do all the work. We just wait to be told to reload or stop.
+	#ifndef WIN32
+	while (piRunning())
+	{
+		if (sigwait(&signals,&sig))
+			continue;
+		if (sig==SIGHUP)
+		{
+			fputs("Reloading pages\n",stderr);
+			magReload();
+		}
+		else if (sig==SIGUSR1)
+		{
+			streamReport(stderr);	// How the lines are being shared out
+			outputReport(stderr);
+		}
+		else
+			piStop();
+	}
+	#else
+	signal(SIGINT,stopHandler);
+	signal(SIGTERM,stopHandler);
+	while (piRunning())
+		delay(100);
+	#endif
+
+	// Orderly shutdown. Producers first so that the output gets everything they sent.
+	serverStop();
+	magStop();
+	samplerStop();
+	metricsStop();
+	bufferInterrupt(streamBuffer);
+	pthread_join(streamThread,NULL);
+	pthread_join(outputThread,NULL);
+	outputReport(stderr);
+	fputs("Finished\n",stderr);
+	return 0;
+}
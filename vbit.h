@@ -7,6 +7,7 @@
 // System
 #include <fcntl.h>
 #include <time.h>
+#include <signal.h>
 
 #ifdef WIN32
 #include <winsock2.h>
@@ -30,7 +31,9 @@
 #include "stream.h"
 #include "mag.h"
 #include "outputstream.h"
+#include "benchmode.h"
 #include "settings.h"
+#include "server.h"
 
 // Pi specific
 #include "thread.h"